@@ -1,15 +1,34 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdatomic.h>
+#ifdef USE_PEXT
+    #ifndef __BMI2__
+        #error "USE_PEXT needs BMI2, build with -mbmi2 or -march=native"
+    #endif
+    #include <immintrin.h>
+#endif
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
 #ifdef WIN64
     #include <windows.h>
+    #include <malloc.h>
+    #include <intrin.h>
 #else
-    # include <sys/time.h>
+    # include <time.h>
+    # include <sys/mman.h>
 #endif
 
 #define U64 unsigned long long
 
+// every search thread owns a private copy of the board and search state
+#define per_thread _Thread_local
+
 #define get_bit(bitboard, bit) (bitboard & (1ULL << bit))
 #define set_bit(bitboard, bit) (bitboard |= (1ULL << bit))
 #define pop_bit(bitboard, bit) (get_bit(bitboard, bit) ? bitboard ^= (1ULL << bit) : 0)
@@ -19,7 +38,10 @@
 #define killer_position "rnbqkb1r/pp1p1pPp/8/2p1pP2/1P1P4/3P3P/P1P1P3/RNBQKBNR w KQkq e6 0 1"
 #define cmk_position "r2q1rk1/ppp2ppp/2n1bn2/2b1p3/3pP3/3P1NPP/PPP1NPB1/R1BQ1RK1 b - - 0 9 "
 
-#define hash_size 0x400000
+// default and maximum transposition table size in MB
+#define default_hash_mb 64
+#define max_hash_mb 65536
+#define max_perft_hash_mb 4096
 #define no_hash_entry 100000
 
 #define hash_flag_exact 0
@@ -31,16 +53,21 @@
 
 #define max_ply 64
 
+#define max_threads 256
+
+// search depth of the "bench" command when none is given
+#define default_bench_depth 10
+
 // encode move
 #define encode_move(source, target, piece, promoted, capture, double, enpassant, castling) \
-    (source) |          \
-    (target << 6) |     \
-    (piece << 12) |     \
-    (promoted << 16) |  \
-    (capture << 20) |   \
-    (double << 21) |    \
-    (enpassant << 22) | \
-    (castling << 23)    \
+    ((source) |           \
+    ((target) << 6) |     \
+    ((piece) << 12) |     \
+    ((promoted) << 16) |  \
+    ((capture) << 20) |   \
+    ((double) << 21) |    \
+    ((enpassant) << 22) | \
+    ((castling) << 23))   \
 
 #define get_move_source(move) (move & 0x3f)
 #define get_move_target(move) ((move & 0xfc0) >> 6)
@@ -51,22 +78,6 @@
 #define get_move_enpassant(move) (move & 0x400000)
 #define get_move_castling(move) (move & 0x800000)
 
-// preserve board state
-#define copy_board()                                                      \
-    U64 board_copy[12], occupancy_copy[3];								  \
-    int side_copy, enpassant_copy, castle_copy;                           \
-    memcpy(board_copy, board, 96);										  \
-    memcpy(occupancy_copy, occupancy, 24);                                \
-    side_copy = side, enpassant_copy = enpassant, castle_copy = castle;   \
-    U64 hash_key_copy = hash_key;									      \
-
-// restore board state
-#define take_back()                                                       \
-    memcpy(board, board_copy, 96);										  \
-    memcpy(occupancy, occupancy_copy, 24);                                \
-    side = side_copy, enpassant = enpassant_copy, castle = castle_copy;   \
-    hash_key = hash_key_copy											  \
-
 enum {
 	a8, b8, c8, d8, e8, f8, g8, h8,
 	a7, b7, c7, d7, e7, f7, g7, h7,
@@ -82,25 +93,45 @@ enum { white, black, both };
 
 enum { rook, bishop };
 
-enum { all_moves, only_captures };
+enum { all_moves, only_captures, only_quiets };
 
 enum { wk = 1, wq = 2, bk = 4, bq = 8 };
 
-enum { P, N, B, R, Q, K, p, n, b, r, q, k };
+enum { P, N, B, R, Q, K, p, n, b, r, q, k, no_piece };
 
 typedef struct {
 	int moves[256];
+	int scores[256];
 	int count;
 } move_list;
 
+// entries are written lock-free by all threads, so the key is stored
+// xored with the data and a torn entry simply fails the key check
 typedef struct {
 	U64 hash_key;
-	int depth;
-	int flag;
-	int score;
+	U64 data;
 } tt;
 
-tt transpos_table[hash_size];
+// pack best move, depth, flag and score into a single tt data word
+#define tt_pack(move, depth, flag, score) \
+    ((U64)((move) & 0xffffff) |       \
+    ((U64)((depth) & 0xff) << 24) |   \
+    ((U64)((flag) & 0x3) << 32) |     \
+    ((U64)(long long)(score) << 40))
+
+#define tt_move(data) ((int)((data) & 0xffffff))
+#define tt_depth(data) ((int)(((data) >> 24) & 0xff))
+#define tt_flag(data) ((int)(((data) >> 32) & 0x3))
+#define tt_score(data) ((int)((long long)(data) >> 40))
+
+// transposition table, allocated on first use with the size of the UCI "Hash" option
+tt* transpos_table = NULL;
+U64 hash_entries = 0;
+int hash_mb = default_hash_mb;
+
+// size of the current allocation and whether it came from explicit hugepages
+size_t hash_bytes = 0;
+int hash_hugetlb = 0;
 
 const int INF = 50000;
 
@@ -239,6 +270,24 @@ const int mirror_score[128] =
 	a8, b8, c8, d8, e8, f8, g8, h8
 };
 
+// material plus positional score of every piece on every square, from white's point of view
+int piece_square_score[12][64];
+
+// pawn structure terms
+const int doubled_pawn_penalty = -10;
+const int isolated_pawn_penalty = -10;
+const int backward_pawn_penalty = -8;
+
+// passed pawn bonus by rank, counted from the pawn's own side
+const int passed_pawn_bonus[8] = { 0, 10, 15, 25, 40, 60, 90, 0 };
+
+// files, neighbouring files, squares in front of a pawn a passer needs free of enemy pawns,
+// and squares behind or beside it own pawns could support it from
+U64 file_masks[8];
+U64 adjacent_files_masks[8];
+U64 passed_masks[2][64];
+U64 support_masks[2][64];
+
 // MVV LVA [attacker][victim]
 static int mvv_lva[12][12] = {
 	105, 205, 305, 405, 505, 605,  105, 205, 305, 405, 505, 605,
@@ -261,6 +310,9 @@ const U64 not_H_file = 9187201950435737471ULL;
 const U64 not_HG_file = 4557430888798830399ULL;
 const U64 not_AB_file = 18229723555195321596ULL;
 
+const U64 rank_8 = 0xffULL;
+const U64 rank_1 = 0xff00000000000000ULL;
+
 // castling rights update constants
 const int castling_rights[64] = {
 	 7, 15, 15, 15,  3, 15, 15, 11,
@@ -433,51 +485,191 @@ U64 bishop_magic_numbers[64] = {
 	0x4010011029020020ULL
 };
 
+// slider attack sets of every square packed back to back, 2^relevant bits each
+#define bishop_table_size 5248
+#define rook_table_size 102400
+
+// everything one slider lookup needs, the magic is unused by the PEXT backend
+typedef struct {
+	U64 mask;
+	U64 magic;
+	const U64* attacks;
+	int shift;
+} slider_magic;
+
+// bishop and rook entries of a square share one cache line
+typedef struct {
+	_Alignas(64) slider_magic bishop;
+	slider_magic rook;
+} slider_square;
+
+// "./engine gentables > tables.h" writes the tables below as const data, build
+// with -DUSE_GENERATED_TABLES (and the same USE_PEXT setting) to skip computing them
+#ifdef USE_GENERATED_TABLES
+    #include "tables.h"
+
+    #if defined(USE_PEXT) != generated_tables_pext
+        #error "tables.h was generated for the other slider backend, rerun gentables"
+    #endif
+#else
 U64 pawn_attacks[2][64];
 U64 knight_attacks[64];
 U64 king_attacks[64];
-U64 bishop_attacks[64][512];
-U64 rook_attacks[64][4096];
 
-U64 rook_masks[64];
-U64 bishop_masks[64];
+U64 slider_attacks[bishop_table_size + rook_table_size];
 
-U64 board[12];
-U64 occupancy[3];
+slider_square sliders[64];
+
+// squares strictly between two aligned squares, and the full line through them
+U64 between_squares[64][64];
+U64 line_squares[64][64];
+#endif
+
+per_thread U64 board[12];
+per_thread U64 occupancy[3];
+
+// piece standing on every square, kept next to the bitboards
+per_thread int piece_on[64];
+
+per_thread U64 hash_key;
+
+// key of the pawns alone, indexes the pawn hash table
+per_thread U64 pawn_key;
 
-U64 hash_key;
 U64 piece_keys[12][64];
 U64 enpassant_keys[64];
 U64 castle_keys[16];
 U64 side_key;
 
 // repetition table
-U64 repetition_table[1000];	
+per_thread U64 repetition_table[1000];
+
+per_thread int rep_index = 0;
+
+per_thread int killer_moves[2][max_ply];
+per_thread int history_moves[12][64];
 
-int rep_index = 0;
+per_thread int side = -1;
+per_thread int enpassant = no_sqr;
+per_thread int castle;
 
-int killer_moves[2][64];
-int history_moves[12][64];
+per_thread int ply;
 
-int side = -1;
-int enpassant = no_sqr;
-int castle;
+// running material and positional score, updated by make_move (white's point of view)
+per_thread int psqt_score;
 
-int ply;
+// state make_move can't restore by itself, one record per move on the stack
+typedef struct {
+	int move;
+	int captured;
+	int castle;
+	int enpassant;
+	int psqt_score;
+	U64 hash_key;
+	U64 pawn_key;
+} undo_info;
+
+per_thread undo_info undo_stack[1000];
+per_thread int undo_count;
+
+// one extra ply for the empty PV of nodes cut off at max ply
+per_thread int pv_length[max_ply + 1];
+per_thread int pv_table[max_ply + 1][max_ply + 1];
+
+per_thread int follow_pv;
+
+per_thread long nodes;
+
+// deepest ply reached in the current search, including quiescence
+per_thread int seldepth;
+
+// search counters, compiled in with -DSEARCH_STATS and reported as "info string"
+typedef struct {
+	U64 tt_probes;
+	U64 tt_hits;
+	U64 tt_cutoffs;
+	U64 fail_highs;
+	U64 fail_highs_first;
+	U64 null_tries;
+	U64 null_cutoffs;
+	U64 lmr_searches;
+	U64 lmr_researches;
+	U64 main_nodes;
+	U64 quiescence_nodes;
+	U64 pawn_probes;
+	U64 pawn_hits;
+	U64 eval_probes;
+	U64 eval_hits;
+} search_stats;
+
+#ifdef SEARCH_STATS
+per_thread search_stats stats;
+
+#define stat_inc(counter) (stats.counter++)
+#else
+#define stat_inc(counter) ((void)0)
+#endif
+
+// index of the search thread, 0 is the main thread talking to the GUI
+per_thread int thread_id = 0;
 
-int pv_length[64];
-int pv_table[64][64];
+// UCI "Threads" option
+int thread_count = 1;
 
-int score_pv, follow_pv;
+// node counts published by every search thread, summed for "info" output
+atomic_long thread_nodes[max_threads];
+
+// snapshot of the board used to hand the root position to helper threads
+typedef struct {
+	U64 board[12];
+	U64 occupancy[3];
+	int piece_on[64];
+	U64 hash_key;
+	U64 pawn_key;
+	U64 repetition_table[1000];
+	int rep_index;
+	int side;
+	int enpassant;
+	int castle;
+	int psqt_score;
+} position;
 
 const int full_depth_moves = 4;
 const int reduction_limit = 2;
 
-// exit from engine flag
-int quit = 0;
+// forward pruning margins (centipawns) and the depths they apply up to, tunable through setoption
+int rfp_margin = 120;
+int rfp_depth = 3;
+int futility_margin = 150;
+int futility_depth = 3;
+int razor_margin = 300;
+int razor_depth = 2;
+int lmp_base = 3;
+int lmp_depth = 3;
+int delta_margin = 200;
+
+// UCI spin options of the tunables above
+typedef struct {
+	char* name;
+	int* value;
+	int min;
+	int max;
+} tune_option;
+
+tune_option tune_options[] = {
+	{ "RFPMargin", &rfp_margin, 0, 1000 },
+	{ "RFPDepth", &rfp_depth, 0, 10 },
+	{ "FutilityMargin", &futility_margin, 0, 1000 },
+	{ "FutilityDepth", &futility_depth, 0, 10 },
+	{ "RazorMargin", &razor_margin, 0, 2000 },
+	{ "RazorDepth", &razor_depth, 0, 10 },
+	{ "LMPBase", &lmp_base, 0, 64 },
+	{ "LMPDepth", &lmp_depth, 0, 10 },
+	{ "DeltaMargin", &delta_margin, 0, 2000 }
+};
 
 // UCI "movestogo" command moves counter
-int movestogo = 30;
+int movestogo = 0;
 
 // UCI "movetime" command time counter
 int movetime = -1;
@@ -488,176 +680,106 @@ int ttime = -1;
 // UCI "inc" command's time increment holder
 int inc = 0;
 
-// UCI "starttime" command time holder
-int starttime = 0;
-
-// UCI "stoptime" command time holder
-int stoptime = 0;
+// UCI "Move Overhead" option, time kept back for GUI and network lag (ms)
+int move_overhead = 10;
 
-// variable to flag time control availability
-int timeset = 0;
+// search start time (us)
+long long starttime = 0;
 
-// variable to flag when the time is up
-int stopped = 0;
+// no new iteration is started past the soft limit (us)
+long long soft_stop = 0;
 
-int get_time_ms()
-{
-	#ifdef WIN64
-        return GetTickCount();
-    #else
-        struct timeval time_value;
-        gettimeofday(&time_value, NULL);
-        return time_value.tv_sec * 1000 + time_value.tv_usec / 1000;
-    #endif
-}
+// the search is aborted wherever it is at the hard limit (us)
+long long hard_stop = 0;
 
-int input_waiting()
-{
-	#ifndef WIN32
-        fd_set readfds;
-        struct timeval tv;
-        FD_ZERO (&readfds);
-        FD_SET (fileno(stdin), &readfds);
-        tv.tv_sec=0; tv.tv_usec=0;
-        select(16, &readfds, 0, 0, &tv);
-
-        return (FD_ISSET(fileno(stdin), &readfds));
-    #else
-        static int init = 0, pipe;
-        static HANDLE inh;
-        DWORD dw;
-
-        if (!init)
-        {
-            init = 1;
-            inh = GetStdHandle(STD_INPUT_HANDLE);
-            pipe = !GetConsoleMode(inh, &dw);
-            if (!pipe)
-            {
-                SetConsoleMode(inh, dw & ~(ENABLE_MOUSE_INPUT|ENABLE_WINDOW_INPUT));
-                FlushConsoleInputBuffer(inh);
-            }
-        }
-        
-        if (pipe)
-        {
-           if (!PeekNamedPipe(inh, NULL, 0, NULL, &dw, NULL)) return 1;
-           return dw;
-        }
-        
-        else
-        {
-           GetNumberOfConsoleInputEvents(inh, &dw);
-           return dw <= 1 ? 0 : dw;
-        }
-    #endif
-}
+// variable to flag time control availability
+int timeset = 0;
 
+// "go ponder" searches on the opponent's time until "ponderhit" starts the clock
+atomic_int pondering = 0;
 
-// read GUI/user input
-void read_input()
-{
-	// bytes to read holder
-	int bytes;
+// "go infinite" searches until "stop"
+int infinite = 0;
 
-	// GUI/user input
-	char input[256] = "", * endc;
+// UCI "Ponder" option, the GUI lets us think on the opponent's time
+int ponder_option = 0;
 
-	// "listen" to STDIN
-	if (input_waiting())
-	{
-		// tell engine to stop calculating
-		stopped = 1;
+// set by the UCI thread on "stop" or by the clock, shared by all search threads
+atomic_int stopped = 0;
 
-		// loop to read bytes from STDIN
-		do
-		{
-			// read bytes from STDIN
-			bytes = read(fileno(stdin), input, 256);
-		}
+// a search that is done but may not report yet waits for "stop" or "ponderhit"
+pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;
 
-		// until bytes available
-		while (bytes < 0);
+// serialises output lines of the search and UCI threads
+pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
 
-		// searches for the first occurrence of '\n'
-		endc = strchr(input, '\n');
+// monotonic clock in microseconds, wall clock adjustments don't affect it
+long long get_time_us()
+{
+#ifdef WIN64
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
 
-		// if found new line set value at pointer to 0
-		if (endc) *endc = 0;
+	if (!frequency.QuadPart)
+		QueryPerformanceFrequency(&frequency);
 
-		// if input is available
-		if (strlen(input) > 0)
-		{
-			// match UCI "quit" command
-			if (!strncmp(input, "quit", 4))
-			{
-				// tell engine to terminate exacution    
-				quit = 1;
-			}
+	QueryPerformanceCounter(&counter);
 
-			// // match UCI "stop" command
-			else if (!strncmp(input, "stop", 4)) {
-				// tell engine to terminate exacution
-				quit = 1;
-			}
-		}
-	}
-}
+	return counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart;
+#else
+	struct timespec now;
 
-// a bridge function to interact between search and GUI input
-static void communicate() {
-	// if time is up break here
-	if (timeset == 1 && get_time_ms() > stoptime) {
-		// tell engine to stop calculating
-		stopped = 1;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
 
-	// read GUI input
-	read_input();
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+#endif
 }
 
-unsigned int seed = 1804289383;
+// clock reading at startup, keeps millisecond times small
+long long clock_start = 0;
 
-unsigned int get_random_number()
+// milliseconds since the engine started
+int get_time_ms()
 {
-	unsigned int num = seed;
-
-	num ^= num << 13;
-	num ^= num >> 17;
-	num ^= num << 5;
-
-	return num;
+	return (int)((get_time_us() - clock_start) / 1000);
 }
 
-unsigned int get_random_U32_number()
+// the search only watches the clock, input is handled by the UCI thread
+static inline void communicate()
 {
-	unsigned int number = seed;
-
-	// XOR shift algorithm
-	number ^= number << 13;
-	number ^= number >> 17;
-	number ^= number << 5;
+	atomic_store_explicit(&thread_nodes[thread_id], nodes, memory_order_relaxed);
 
-	seed = number;
+	// helper threads only follow the shared stop flag
+	if (thread_id)
+		return;
 
-	return number;
+	// if time is up break here, the clock isn't ours while pondering
+	if (timeset == 1 && !pondering && get_time_us() > hard_stop)
+		stopped = 1;
 }
 
-U64 get_random_U64_number()
+U64 key_seed = 1804289383;
+
+// splitmix64, hashing keys must not be linearly dependent like the xorshift output
+U64 get_random_key()
 {
-	U64 n1, n2, n3, n4;
+	U64 z = (key_seed += 0x9e3779b97f4a7c15ULL);
 
-	// init random numbers slicing 16 bits from MS1B side
-	n1 = (U64)(get_random_U32_number()) & 0xFFFF;
-	n2 = (U64)(get_random_U32_number()) & 0xFFFF;
-	n3 = (U64)(get_random_U32_number()) & 0xFFFF;
-	n4 = (U64)(get_random_U32_number()) & 0xFFFF;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
 
-	return n1 | (n2 << 16) | (n3 << 32) | (n4 << 48);
+	return z ^ (z >> 31);
 }
 
+// hardware popcnt and tzcnt when the compiler exposes them, build with -mpopcnt -mbmi
 static inline int count_bits(U64 bitboard)
 {
+#if defined(__GNUC__)
+	return __builtin_popcountll(bitboard);
+#elif defined(_MSC_VER) && defined(_WIN64)
+	return (int)__popcnt64(bitboard);
+#else
 	int count = 0;
 
 	while (bitboard)
@@ -668,14 +790,35 @@ static inline int count_bits(U64 bitboard)
 	}
 
 	return count;
+#endif
 }
 
 static inline int get_lsb(U64 bitboard)
 {
-	if (bitboard)
-		return count_bits((bitboard & -bitboard) - 1);
-	else
+	if (!bitboard)
 		return -1;
+
+#if defined(__GNUC__)
+	return __builtin_ctzll(bitboard);
+#elif defined(_MSC_VER) && defined(_WIN64)
+	unsigned long index;
+
+	_BitScanForward64(&index, bitboard);
+
+	return (int)index;
+#else
+	return count_bits((bitboard & -bitboard) - 1);
+#endif
+}
+
+// index of the least significant bit, which is cleared from the bitboard
+static inline int pop_lsb(U64* bitboard)
+{
+	int square = get_lsb(*bitboard);
+
+	*bitboard &= *bitboard - 1;
+
+	return square;
 }
 
 U64 mask_pawn_attacks(int square, int side)
@@ -874,15 +1017,9 @@ void print_board()
 			if (!file)
 				printf(" %d", 8 - rank);
 
-			int target_piece = -1;
-
-			for (int piece = P; piece <= k; piece++)
-			{
-				if (get_bit(board[piece], square))
-					target_piece = piece;
-			}
+			int target_piece = piece_on[square];
 
-			printf(" %c", (target_piece == -1) ? '.' : ascii_pieces[target_piece]);
+			printf(" %c", (target_piece == no_piece) ? '.' : ascii_pieces[target_piece]);
 		}
 
 		printf("\n");
@@ -896,6 +1033,302 @@ void print_board()
 	printf("    Hash key: %llx\n\n", hash_key);
 }
 
+/**********************************\
+ ==================================
+
+               NNUE
+
+ ==================================
+\**********************************/
+
+// optional neural network evaluation, loaded with the UCI "EvalFile" option
+//
+// network: 768 inputs -> 256 x 2 accumulators -> 1 output
+//
+// every side has its own accumulator over the 768 piece-square features
+// (12 pieces x 64 squares, a8 = 0 as on the board), seen from that side:
+// black's features swap piece colours and mirror the square vertically,
+// so both sides look at the board as white. The two accumulators are
+// clipped to 0..nnue_qa, the side to move first, and weighted into one output.
+//
+// file format, little endian, nnue_file_size bytes in total:
+//
+//   0   char  magic[4]                 "LCNN"
+//   4   int   version                  1
+//   8   int   hidden                   256, size of one accumulator
+//  12   int   scale                    centipawns = output * scale / (nnue_qa * nnue_qb)
+//  16   short feature_weights[768][256]  feature index = piece * 64 + square
+//       short feature_biases[256]
+//       signed char output_weights[512]  side to move half first
+//       int   output_bias
+#define nnue_hidden 256
+#define nnue_features 768
+#define nnue_qa 255
+#define nnue_qb 64
+
+#define nnue_header_size 16
+#define nnue_file_size (nnue_header_size + nnue_features * nnue_hidden * 2 + nnue_hidden * 2 + nnue_hidden * 2 + 4)
+
+// network weights, pointing into the mapped file while a network is loaded
+const short* nnue_feature_weights = NULL;
+const short* nnue_feature_biases = NULL;
+_Alignas(32) short nnue_output_weights[2 * nnue_hidden];
+int nnue_output_bias;
+int nnue_scale;
+
+// the file mapping backing the weights
+void* nnue_mapping = NULL;
+
+// UCI "EvalFile" option
+char eval_file[1024] = "";
+
+// accumulators of both sides, updated by make_move and unmake_move
+per_thread _Alignas(32) short accumulator[2][nnue_hidden];
+
+// feature rows of a piece on a square for white's and black's accumulator
+static inline const short* nnue_row(int color, int piece, int square)
+{
+	if (color == black)
+	{
+		piece = (piece + 6) % 12;
+		square ^= 56;
+	}
+
+	return nnue_feature_weights + (piece * 64 + square) * nnue_hidden;
+}
+
+static inline void nnue_add(int piece, int square)
+{
+	for (int color = white; color <= black; color++)
+	{
+		const short* row = nnue_row(color, piece, square);
+
+		for (int i = 0; i < nnue_hidden; i++)
+			accumulator[color][i] += row[i];
+	}
+}
+
+static inline void nnue_remove(int piece, int square)
+{
+	for (int color = white; color <= black; color++)
+	{
+		const short* row = nnue_row(color, piece, square);
+
+		for (int i = 0; i < nnue_hidden; i++)
+			accumulator[color][i] -= row[i];
+	}
+}
+
+// piece moving on the board, the most common update
+static inline void nnue_move(int piece, int from_square, int to_square)
+{
+	for (int color = white; color <= black; color++)
+	{
+		const short* from_row = nnue_row(color, piece, from_square);
+		const short* to_row = nnue_row(color, piece, to_square);
+
+		for (int i = 0; i < nnue_hidden; i++)
+			accumulator[color][i] += to_row[i] - from_row[i];
+	}
+}
+
+// build both accumulators from scratch
+void nnue_refresh()
+{
+	if (!nnue_feature_weights)
+		return;
+
+	memcpy(accumulator[white], nnue_feature_biases, sizeof(accumulator[white]));
+	memcpy(accumulator[black], nnue_feature_biases, sizeof(accumulator[black]));
+
+	for (int piece = P; piece <= k; piece++)
+	{
+		U64 bitboard = board[piece];
+
+		while (bitboard)
+			nnue_add(piece, pop_lsb(&bitboard));
+	}
+}
+
+// clipped accumulator times output weights, summed in 32 bits
+static inline int nnue_dot(const short* values, const short* weights)
+{
+#if defined(__AVX2__)
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i max = _mm256_set1_epi16(nnue_qa);
+
+	__m256i sum = _mm256_setzero_si256();
+
+	for (int i = 0; i < nnue_hidden; i += 16)
+	{
+		__m256i v = _mm256_load_si256((const __m256i*)(values + i));
+		__m256i w = _mm256_load_si256((const __m256i*)(weights + i));
+
+		v = _mm256_min_epi16(_mm256_max_epi16(v, zero), max);
+		sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, w));
+	}
+
+	__m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4e));
+	sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xb1));
+
+	return _mm_cvtsi128_si32(sum128);
+#elif defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i max = _mm_set1_epi16(nnue_qa);
+
+	__m128i sum = _mm_setzero_si128();
+
+	for (int i = 0; i < nnue_hidden; i += 8)
+	{
+		__m128i v = _mm_load_si128((const __m128i*)(values + i));
+		__m128i w = _mm_load_si128((const __m128i*)(weights + i));
+
+		v = _mm_min_epi16(_mm_max_epi16(v, zero), max);
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(v, w));
+	}
+
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+
+	return _mm_cvtsi128_si32(sum);
+#else
+	int sum = 0;
+
+	for (int i = 0; i < nnue_hidden; i++)
+	{
+		int v = values[i];
+
+		if (v < 0) v = 0;
+		if (v > nnue_qa) v = nnue_qa;
+
+		sum += v * weights[i];
+	}
+
+	return sum;
+#endif
+}
+
+// network score of the position from the side to move's point of view
+static inline int nnue_evaluate()
+{
+	int output = nnue_dot(accumulator[side], nnue_output_weights) +
+		nnue_dot(accumulator[side ^ 1], nnue_output_weights + nnue_hidden) + nnue_output_bias;
+
+	return (int)((long long)output * nnue_scale / (nnue_qa * nnue_qb));
+}
+
+void unmap_file(void* data)
+{
+#ifdef WIN64
+	UnmapViewOfFile(data);
+#else
+	munmap(data, nnue_file_size);
+#endif
+}
+
+void nnue_unload()
+{
+	if (!nnue_mapping)
+		return;
+
+	unmap_file(nnue_mapping);
+
+	nnue_mapping = NULL;
+	nnue_feature_weights = NULL;
+	nnue_feature_biases = NULL;
+}
+
+// map a network file read only, NULL if it can't be opened or has the wrong size
+void* map_file(const char* path)
+{
+	void* data = NULL;
+
+#ifdef WIN64
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	LARGE_INTEGER size;
+
+	if (GetFileSizeEx(file, &size) && size.QuadPart == nnue_file_size)
+	{
+		HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+		if (mapping)
+		{
+			data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+	}
+
+	CloseHandle(file);
+#else
+	FILE* file = fopen(path, "rb");
+
+	if (!file)
+		return NULL;
+
+	if (fseek(file, 0, SEEK_END) == 0 && ftell(file) == nnue_file_size)
+	{
+		data = mmap(NULL, nnue_file_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+		if (data == MAP_FAILED)
+			data = NULL;
+	}
+
+	fclose(file);
+#endif
+
+	return data;
+}
+
+// load the network of the "EvalFile" option, an empty name goes back to the hand-crafted eval
+void nnue_load(const char* path)
+{
+	nnue_unload();
+
+	if (!*path || strcmp(path, "<empty>") == 0)
+		return;
+
+	char* data = map_file(path);
+
+	if (!data)
+	{
+		printf("info string cannot load network %s\n", path);
+		return;
+	}
+
+	int header[4];
+	memcpy(header, data, sizeof(header));
+
+	if (memcmp(data, "LCNN", 4) || header[1] != 1 || header[2] != nnue_hidden)
+	{
+		printf("info string %s is not a supported network\n", path);
+		unmap_file(data);
+		return;
+	}
+
+	nnue_mapping = data;
+	nnue_scale = header[3];
+
+	// feature rows are read in place from the mapping, the accumulator loops don't need alignment
+	nnue_feature_weights = (const short*)(data + nnue_header_size);
+	nnue_feature_biases = nnue_feature_weights + nnue_features * nnue_hidden;
+
+	// the small output layer is widened to 16 bits for the multiply-add kernels
+	const signed char* output_weights = (const signed char*)(nnue_feature_biases + nnue_hidden);
+
+	for (int i = 0; i < 2 * nnue_hidden; i++)
+		nnue_output_weights[i] = output_weights[i];
+
+	memcpy(&nnue_output_bias, output_weights + 2 * nnue_hidden, sizeof(nnue_output_bias));
+
+	printf("info string loaded network %s\n", path);
+}
+
 U64 generate_hash_key()
 {
 	U64 final_key = 0ULL;
@@ -908,11 +1341,9 @@ U64 generate_hash_key()
 
 		while (bitboard)
 		{
-			int square = get_lsb(bitboard);
+			int square = pop_lsb(&bitboard);
 
 			final_key ^= piece_keys[piece][square];
-
-			pop_bit(bitboard, square);
 		}
 	}
 
@@ -926,22 +1357,62 @@ U64 generate_hash_key()
 	return final_key;
 }
 
+U64 generate_pawn_key()
+{
+	U64 final_key = 0ULL;
+
+	for (int piece = P; piece <= p; piece += p - P)
+	{
+		U64 bitboard = board[piece];
+
+		while (bitboard)
+			final_key ^= piece_keys[piece][pop_lsb(&bitboard)];
+	}
+
+	return final_key;
+}
+
+// material and positional score of the whole board, from scratch
+int compute_psqt_score()
+{
+	int score = 0;
+
+	for (int piece = P; piece <= k; piece++)
+	{
+		U64 bitboard = board[piece];
+
+		while (bitboard)
+		{
+			int square = pop_lsb(&bitboard);
+
+			score += piece_square_score[piece][square];
+		}
+	}
+
+	return score;
+}
+
 void parse_fen(char* fen)
 {
 	memset(board, 0ULL, sizeof(board));
 	memset(occupancy, 0ULL, sizeof(occupancy));
 
+	for (int square = 0; square < 64; square++)
+		piece_on[square] = no_piece;
+
 	side = 0;
 	enpassant = no_sqr;
 	castle = 0;
 
 	hash_key = 0ULL;
+	pawn_key = 0ULL;
 
 	rep_index = 0;
 
 	memset(repetition_table, 0, sizeof(repetition_table));
 
 	ply = 0;
+	undo_count = 0;
 
 	for (int rank = 0; rank < 8; rank++)
 	{
@@ -954,6 +1425,7 @@ void parse_fen(char* fen)
 				int piece = char_pieces[*fen];
 
 				set_bit(board[piece], square);
+				piece_on[square] = piece;
 
 				fen++;
 			}
@@ -962,15 +1434,7 @@ void parse_fen(char* fen)
 			{
 				int offset = *fen - '0';
 
-				int target_piece = -1;
-
-				for (int piece = P; piece <= k; piece++)
-				{
-					if (get_bit(board[piece], square))
-						target_piece = piece;
-				}
-
-				if (target_piece == -1)
+				if (piece_on[square] == no_piece)
 					file--;
 
 				file += offset;
@@ -1037,6 +1501,11 @@ void parse_fen(char* fen)
 	occupancy[both] |= occupancy[black];
 
 	hash_key = generate_hash_key();
+	pawn_key = generate_pawn_key();
+
+	psqt_score = compute_psqt_score();
+
+	nnue_refresh();
 }
 
 U64 set_occupancy(int index, int bits_in_mask, U64 attack_mask)
@@ -1045,18 +1514,27 @@ U64 set_occupancy(int index, int bits_in_mask, U64 attack_mask)
 
 	for (int count = 0; count < bits_in_mask; count++)
 	{
-		int square = get_lsb(attack_mask);
+		int square = pop_lsb(&attack_mask);
 
 		// make sure occupancy is on board
 		if (index & (1 << count))
 			occupancy |= (1ULL << square);
-
-		pop_bit(attack_mask, square);
 	}
 
 	return occupancy;
 }
 
+// index of an occupancy into the attack sets of a square
+static inline int slider_index(const slider_magic* entry, U64 occupancy)
+{
+#ifdef USE_PEXT
+	return (int)_pext_u64(occupancy, entry->mask);
+#else
+	return (int)(((occupancy & entry->mask) * entry->magic) >> entry->shift);
+#endif
+}
+
+#ifndef USE_GENERATED_TABLES
 void init_leaper_attacks()
 {
 	for (int square = 0; square < 64; square++)
@@ -1071,51 +1549,70 @@ void init_leaper_attacks()
 
 void init_slider_attacks(int bishop)
 {
+	U64* attacks = bishop ? slider_attacks : slider_attacks + bishop_table_size;
+
 	for (int square = 0; square < 64; square++)
 	{
-		bishop_masks[square] = mask_bishop_attacks(square);
-		rook_masks[square] = mask_rook_attacks(square);
+		slider_magic* entry = bishop ? &sliders[square].bishop : &sliders[square].rook;
 
-		U64 attack_mask = bishop ? bishop_masks[square] : rook_masks[square];
+		int relevant_bits = bishop ? bishop_relevant_bits[square] : rook_relevant_bits[square];
 
-		int relevant_bits = count_bits(attack_mask);
+		entry->mask = bishop ? mask_bishop_attacks(square) : mask_rook_attacks(square);
+		entry->magic = bishop ? bishop_magic_numbers[square] : rook_magic_numbers[square];
+		entry->shift = 64 - relevant_bits;
+		entry->attacks = attacks;
 
 		int occupancy_indices = (1 << relevant_bits);
 
 		for (int index = 0; index < occupancy_indices; index++)
 		{
-			if (bishop)
+			U64 occupancy = set_occupancy(index, relevant_bits, entry->mask);
+
+			attacks[slider_index(entry, occupancy)] = bishop ? bishop_attacks_otf(square, occupancy) : rook_attacks_otf(square, occupancy);
+		}
+
+		attacks += occupancy_indices;
+	}
+}
+
+void init_line_tables()
+{
+	for (int from = 0; from < 64; from++)
+	{
+		for (int to = 0; to < 64; to++)
+		{
+			U64 from_bit = 1ULL << from, to_bit = 1ULL << to;
+
+			if (from == to)
+				continue;
+
+			if (bishop_attacks_otf(from, 0ULL) & to_bit)
 			{
-				U64 occupancy = set_occupancy(index, relevant_bits, attack_mask);
-				int magic_index = (occupancy * bishop_magic_numbers[square]) >> (64 - bishop_relevant_bits[square]);
-				bishop_attacks[square][magic_index] = bishop_attacks_otf(square, occupancy);
+				between_squares[from][to] = bishop_attacks_otf(from, to_bit) & bishop_attacks_otf(to, from_bit);
+				line_squares[from][to] = (bishop_attacks_otf(from, 0ULL) & bishop_attacks_otf(to, 0ULL)) | from_bit | to_bit;
 			}
-			else
+			else if (rook_attacks_otf(from, 0ULL) & to_bit)
 			{
-				U64 occupancy = set_occupancy(index, relevant_bits, attack_mask);
-				int magic_index = (occupancy * rook_magic_numbers[square]) >> (64 - rook_relevant_bits[square]);
-				rook_attacks[square][magic_index] = rook_attacks_otf(square, occupancy);
+				between_squares[from][to] = rook_attacks_otf(from, to_bit) & rook_attacks_otf(to, from_bit);
+				line_squares[from][to] = (rook_attacks_otf(from, 0ULL) & rook_attacks_otf(to, 0ULL)) | from_bit | to_bit;
 			}
 		}
 	}
 }
+#endif
 
 static inline U64 get_bishop_attacks(int square, U64 occupancy)
 {
-	occupancy &= bishop_masks[square];
-	occupancy *= bishop_magic_numbers[square];
-	occupancy >>= 64 - bishop_relevant_bits[square];
+	const slider_magic* entry = &sliders[square].bishop;
 
-	return bishop_attacks[square][occupancy];
+	return entry->attacks[slider_index(entry, occupancy)];
 }
 
 static inline U64 get_rook_attacks(int square, U64 occupancy)
 {
-	occupancy &= rook_masks[square];
-	occupancy *= rook_magic_numbers[square];
-	occupancy >>= 64 - rook_relevant_bits[square];
+	const slider_magic* entry = &sliders[square].rook;
 
-	return rook_attacks[square][occupancy];
+	return entry->attacks[slider_index(entry, occupancy)];
 }
 
 static inline U64 get_queen_attacks(int square, U64 occupancy)
@@ -1128,82 +1625,205 @@ static inline U64 get_queen_attacks(int square, U64 occupancy)
 	return attacks;
 }
 
+// pieces of the given side attacking a square, with custom blockers
+static inline U64 attackers_of(int square, int side, U64 blockers)
+{
+	int first_piece = (side == white) ? P : p;
+
+	return (pawn_attacks[side ^ 1][square] & board[first_piece]) |
+		(knight_attacks[square] & board[first_piece + N]) |
+		(king_attacks[square] & board[first_piece + K]) |
+		(get_bishop_attacks(square, blockers) & (board[first_piece + B] | board[first_piece + Q])) |
+		(get_rook_attacks(square, blockers) & (board[first_piece + R] | board[first_piece + Q]));
+}
+
 static inline int is_square_attacked(int square, int side)
 {
-	if ((side == white) && (pawn_attacks[black][square] & board[P]))
-		return 1;
-	if ((side == black) && (pawn_attacks[white][square] & board[p]))
-		return 1;
+	return attackers_of(square, side, occupancy[both]) != 0;
+}
 
-	if (knight_attacks[square] & ((side == white) ? board[N] : board[n]))
-		return 1;
+void init_random_keys()
+{
+	key_seed = 1804289383;
 
-	if (king_attacks[square] & ((side == white) ? board[K] : board[k]))
-		return 1;
+	for (int piece = P; piece <= k; piece++)
+		for (int square = 0; square < 64; square++)
+			piece_keys[piece][square] = get_random_key();
 
-	if (get_bishop_attacks(square, occupancy[both]) & ((side == white) ? board[B] : board[b]))
-		return 1;
+	for (int square = 0; square < 64; square++)
+		enpassant_keys[square] = get_random_key();
 
-	if (get_rook_attacks(square, occupancy[both]) & ((side == white) ? board[R] : board[r]))
-		return 1;
+	for (int i = 0; i < 16; i++)
+		castle_keys[i] = get_random_key();
 
-	if (get_bishop_attacks(square, occupancy[both]) & ((side == white) ? board[B] : board[b]))
-		return 1;
+	side_key = get_random_key();
+}
 
-	if (get_queen_attacks(square, occupancy[both]) & ((side == white) ? board[Q] : board[q]))
-		return 1;
+// upper 64 bits of a 64x64 bit product
+static inline U64 mul_hi64(U64 a, U64 b)
+{
+#ifdef __SIZEOF_INT128__
+	return (U64)(((unsigned __int128)a * b) >> 64);
+#else
+	U64 a_lo = (unsigned int)a, a_hi = a >> 32;
+	U64 b_lo = (unsigned int)b, b_hi = b >> 32;
 
-	return 0;
+	U64 cross = (a_lo * b_lo >> 32) + (unsigned int)(a_hi * b_lo) + a_lo * b_hi;
+
+	return a_hi * b_hi + (a_hi * b_lo >> 32) + (cross >> 32);
+#endif
 }
 
-void init_random_keys()
+// map hash key onto the table with a multiply-shift instead of a division
+static inline tt* tt_entry(U64 key)
 {
-	seed = 1804289383;
+	return &transpos_table[mul_hi64(key, hash_entries)];
+}
 
-	for (int piece = P; piece <= k; piece++)
-		for (int square = 0; square < 64; square++)
-			piece_keys[piece][square] = get_random_U64_number();
+typedef struct {
+	char* start;
+	size_t size;
+} clear_slice;
 
-	for (int square = 0; square < 64; square++)
-		enpassant_keys[square] = get_random_U64_number();
+void* clear_slice_thread(void* arg)
+{
+	clear_slice* slice = arg;
 
-	for (int i = 0; i < 16; i++)
-		castle_keys[i] = get_random_U64_number();
+	memset(slice->start, 0, slice->size);
 
-	side_key = get_random_U64_number();
+	return NULL;
 }
 
+// zero the table with all search threads, each touching its own slice
 void clear_transpos_table()
 {
-	for (int i = 0; i < hash_size; i++)
+	pthread_t workers[max_threads];
+	clear_slice slices[max_threads];
+
+	// nothing to clear before the first allocation
+	if (!transpos_table)
+		return;
+
+	size_t slice_size = hash_bytes / thread_count;
+
+	for (int i = 0; i < thread_count; i++)
+	{
+		slices[i].start = (char*)transpos_table + i * slice_size;
+		slices[i].size = (i == thread_count - 1) ? hash_bytes - i * slice_size : slice_size;
+
+		if (i)
+			pthread_create(&workers[i], NULL, clear_slice_thread, &slices[i]);
+	}
+
+	clear_slice_thread(&slices[0]);
+
+	for (int i = 1; i < thread_count; i++)
+		pthread_join(workers[i], NULL);
+}
+
+void free_transpos_table()
+{
+	if (!transpos_table)
+		return;
+
+#ifdef WIN64
+	_aligned_free(transpos_table);
+#else
+	if (hash_hugetlb)
+		munmap(transpos_table, hash_bytes);
+	else
+		free(transpos_table);
+#endif
+
+	transpos_table = NULL;
+	hash_entries = 0;
+	hash_bytes = 0;
+}
+
+// (re)allocate the transposition table with the given size in MB
+void init_transpos_table(int mb)
+{
+	free_transpos_table();
+
+	// round to a whole number of 2MB pages so hugepages can back all of it
+	size_t page_size = 2 * 1024 * 1024;
+
+	hash_bytes = ((size_t)mb * 1024 * 1024 + page_size - 1) / page_size * page_size;
+	hash_hugetlb = 0;
+
+#ifdef WIN64
+	transpos_table = _aligned_malloc(hash_bytes, page_size);
+#else
+#ifdef MAP_HUGETLB
+	// explicit hugepages if the system has reserved some
+	transpos_table = mmap(NULL, hash_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (transpos_table == MAP_FAILED)
+		transpos_table = NULL;
+	else
+		hash_hugetlb = 1;
+#endif
+
+	// otherwise ask for transparent hugepages on a 2MB aligned block
+	if (!transpos_table)
+	{
+		transpos_table = aligned_alloc(page_size, hash_bytes);
+
+#ifdef MADV_HUGEPAGE
+		if (transpos_table)
+			madvise(transpos_table, hash_bytes, MADV_HUGEPAGE);
+#endif
+	}
+#endif
+
+	if (!transpos_table)
 	{
-		transpos_table[i].hash_key = 0;
-		transpos_table[i].depth = 0;
-		transpos_table[i].flag = 0;
-		transpos_table[i].score = 0;
+		printf("info string failed to allocate %d MB hash\n", mb);
+		exit(1);
 	}
+
+	hash_entries = hash_bytes / sizeof(tt);
+
+	clear_transpos_table();
+}
+
+// allocate the table on first use so startup doesn't pay for it
+void ensure_transpos_table()
+{
+	if (!transpos_table)
+		init_transpos_table(hash_mb);
 }
 
-static inline int read_tt_entry(int depth, int alpha, int beta)
+static inline int read_tt_entry(int depth, int alpha, int beta, int* best_move)
 {
-	tt* hash_entry = &transpos_table[hash_key % hash_size];
+	tt* hash_entry = tt_entry(hash_key);
+
+	U64 data = hash_entry->data;
 
-	if (hash_entry->hash_key == hash_key)
+	stat_inc(tt_probes);
+
+	if ((hash_entry->hash_key ^ data) == hash_key)
 	{
-		if (hash_entry->depth >= depth)
+		stat_inc(tt_hits);
+
+		// hand back the best move even if the score can't be used
+		*best_move = tt_move(data);
+
+		if (tt_depth(data) >= depth)
 		{
-			int score = hash_entry->score;
+			int score = tt_score(data);
+			int flag = tt_flag(data);
 
 			if (score < -mate_score) score += ply;
 			if (score > mate_score) score -= ply;
 
-			if (hash_entry->flag == hash_flag_exact)
+			if (flag == hash_flag_exact)
 				return score;
 
-			if (hash_entry->flag == hash_flag_alpha && score <= alpha)
+			if (flag == hash_flag_alpha && score <= alpha)
 				return alpha;
 
-			if (hash_entry->flag == hash_flag_beta && score >= beta)
+			if (flag == hash_flag_beta && score >= beta)
 				return beta;
 		}
 	}
@@ -1211,24 +1831,30 @@ static inline int read_tt_entry(int depth, int alpha, int beta)
 	return no_hash_entry;
 }
 
-static inline void write_tt_entry(int depth, int score, int hash_flag)
+static inline void write_tt_entry(int depth, int score, int hash_flag, int best_move)
 {
-	tt* hash_entry = &transpos_table[hash_key % hash_size];
+	tt* hash_entry = tt_entry(hash_key);
 
 	if (score < -mate_score) score -= ply;
 	if (score > mate_score) score += ply;
 
-	hash_entry->hash_key = hash_key;
-	hash_entry->score = score;
-	hash_entry->flag = hash_flag;
-	hash_entry->depth = depth;
+	// a fail low has no best move, keep the one already stored for this position
+	if (!best_move && (hash_entry->hash_key ^ hash_entry->data) == hash_key)
+		best_move = tt_move(hash_entry->data);
+
+	U64 data = tt_pack(best_move, depth, hash_flag, score);
+
+	hash_entry->hash_key = hash_key ^ data;
+	hash_entry->data = data;
 }
 
 void print_move(int move)
 {
-	printf("%s%s%c", square_to_coords[get_move_source(move)],
-		square_to_coords[get_move_target(move)],
-		promoted_pieces[get_move_promoted(move)]);
+	printf("%s%s", square_to_coords[get_move_source(move)],
+		square_to_coords[get_move_target(move)]);
+
+	if (get_move_promoted(move))
+		printf("%c", promoted_pieces[get_move_promoted(move)]);
 }
 
 static inline void add_move(move_list* moves, int move)
@@ -1237,993 +1863,2079 @@ static inline void add_move(move_list* moves, int move)
 	moves->count++;
 }
 
-static inline int make_move(int move, int move_flag)
+// move the castling rook, used both ways by make_move and unmake_move
+static inline void move_castling_rook(int king_target)
 {
-	if (move_flag == all_moves)
-	{
-		copy_board();
-
-		int from_square = get_move_source(move);
-		int to_square = get_move_target(move);
-		int piece = get_move_piece(move);
-		int promoted = get_move_promoted(move);
-		int capture = get_move_capture(move);
-		int doublePush = get_move_double(move);
-		int enpass = get_move_enpassant(move);
-		int castling = get_move_castling(move);
-
-		pop_bit(board[piece], from_square);
-		set_bit(board[piece], to_square);
+	int rook_piece, rook_from, rook_to;
 
-		hash_key ^= piece_keys[piece][from_square];
-		hash_key ^= piece_keys[piece][to_square];
+	switch (king_target)
+	{
+	case g1: rook_piece = R; rook_from = h1; rook_to = f1; break;
+	case c1: rook_piece = R; rook_from = a1; rook_to = d1; break;
+	case g8: rook_piece = r; rook_from = h8; rook_to = f8; break;
+	default: rook_piece = r; rook_from = a8; rook_to = d8; break;
+	}
 
-		if (capture)
-		{
-			int start_piece, end_piece;
+	U64 from_to = (1ULL << rook_from) | (1ULL << rook_to);
 
-			if (side == white)
-			{
-				start_piece = p;
-				end_piece = k;
-			}
-			else
-			{
-				start_piece = P;
-				end_piece = K;
-			}
+	board[rook_piece] ^= from_to;
+	occupancy[(rook_piece == R) ? white : black] ^= from_to;
 
-			// loop over bitboards opposite to the current side
-			for (int bb_piece = start_piece; bb_piece <= end_piece; bb_piece++)
-			{
-				if (get_bit(board[bb_piece], to_square))
-				{
-					// removes captured piece
-					pop_bit(board[bb_piece], to_square);
+	// one of the two squares is empty, so swapping works both ways
+	int swap = piece_on[rook_from];
+	piece_on[rook_from] = piece_on[rook_to];
+	piece_on[rook_to] = swap;
 
-					hash_key = piece_keys[bb_piece][to_square];
-					break;
-				}
-			}
-		}
+	hash_key ^= piece_keys[rook_piece][rook_from];
+	hash_key ^= piece_keys[rook_piece][rook_to];
 
-		if (promoted)
-		{
-			pop_bit(board[(side == white) ? P : p], to_square);
+	psqt_score += piece_square_score[rook_piece][rook_to] - piece_square_score[rook_piece][rook_from];
 
-			if (side == white)
-			{
-				pop_bit(board[P], to_square);
-				hash_key ^= piece_keys[P][to_square];
-			}
-			else
-			{
-				pop_bit(board[p], to_square);
-				hash_key ^= piece_keys[p][to_square];
-			}
+	// the rook now stands on rook_to when castling, on rook_from when taking it back
+	if (nnue_feature_weights)
+	{
+		if (piece_on[rook_to] == rook_piece)
+			nnue_move(rook_piece, rook_from, rook_to);
+		else
+			nnue_move(rook_piece, rook_to, rook_from);
+	}
+}
 
-			set_bit(board[promoted], to_square);
-			hash_key ^= piece_keys[promoted][to_square];
-		}
+// moves are legal by construction, see generate_legal_moves
+static inline void make_move(int move)
+{
+	int from_square = get_move_source(move);
+	int to_square = get_move_target(move);
+	int piece = get_move_piece(move);
+	int promoted = get_move_promoted(move);
+	int doublePush = get_move_double(move);
+	int enpass = get_move_enpassant(move);
+	int castling = get_move_castling(move);
 
-		if (enpass)
-		{
-			if (side == white)
-			{
-				pop_bit(board[p], to_square + 8);
-				hash_key ^= piece_keys[p][to_square + 8];
-			}
-			else
-			{
-				pop_bit(board[P], to_square - 8);
-				hash_key ^= piece_keys[P][to_square - 8];
-			}
-		}
-		if (enpassant != no_sqr)
-			hash_key ^= enpassant_keys[enpassant];
+	// empty for quiet moves and en passant
+	int captured = piece_on[to_square];
 
-		enpassant = no_sqr;
+	// remember what can't be recomputed when taking the move back
+	undo_info* undo = &undo_stack[undo_count++];
 
-		if (doublePush)
-		{
-			(side == white) ? (enpassant = to_square + 8) : (enpassant = to_square - 8);
+	undo->move = move;
+	undo->captured = captured;
+	undo->castle = castle;
+	undo->enpassant = enpassant;
+	undo->psqt_score = psqt_score;
+	undo->hash_key = hash_key;
+	undo->pawn_key = pawn_key;
 
-			if (side == white)
-			{
-				enpassant = to_square + 8;
-				hash_key ^= enpassant_keys[to_square + 8];
-			}
-			else
-			{
-				enpassant = to_square - 8;
-				hash_key ^= enpassant_keys[to_square - 8];
-			}
-		}
+	U64 from_to = (1ULL << from_square) | (1ULL << to_square);
 
-		if (castling)
-		{
-			switch (to_square)
-			{
-			case g1:
-				pop_bit(board[R], h1);
-				set_bit(board[R], f1);
+	board[piece] ^= from_to;
+	occupancy[side] ^= from_to;
 
-				hash_key ^= piece_keys[R][h1];
-				hash_key ^= piece_keys[R][f1];
-				break;
-			case c1:
-				pop_bit(board[R], a1);
-				set_bit(board[R], d1);
+	hash_key ^= piece_keys[piece][from_square];
+	hash_key ^= piece_keys[piece][to_square];
 
-				hash_key ^= piece_keys[R][a1];
-				hash_key ^= piece_keys[R][d1];
-				break;
-			case g8:
-				pop_bit(board[r], h8);
-				set_bit(board[r], f8);
+	psqt_score += piece_square_score[piece][to_square] - piece_square_score[piece][from_square];
 
-				hash_key ^= piece_keys[r][h8];
-				hash_key ^= piece_keys[r][f8];
-				break;
-			case c8:
-				pop_bit(board[r], a8);
-				set_bit(board[r], d8);
+	if (piece == P || piece == p)
+		pawn_key ^= piece_keys[piece][from_square] ^ piece_keys[piece][to_square];
 
-				hash_key ^= piece_keys[r][a8];
-				hash_key ^= piece_keys[r][d8];
-				break;
-			}
-		}
+	if (captured != no_piece)
+	{
+		// removes captured piece
+		pop_bit(board[captured], to_square);
+		occupancy[side ^ 1] ^= 1ULL << to_square;
 
-		hash_key ^= castle_keys[castle];
+		hash_key ^= piece_keys[captured][to_square];
+		psqt_score -= piece_square_score[captured][to_square];
 
-		// update castling rights
-		castle &= castling_rights[from_square];
-		castle &= castling_rights[to_square];
+		if (captured == P || captured == p)
+			pawn_key ^= piece_keys[captured][to_square];
+	}
 
-		hash_key ^= castle_keys[castle];
+	piece_on[from_square] = no_piece;
+	piece_on[to_square] = promoted ? promoted : piece;
 
-		// zero out occupancy
-		memset(occupancy, 0ULL, 24);
+	if (promoted)
+	{
+		pop_bit(board[piece], to_square);
+		hash_key ^= piece_keys[piece][to_square];
+		pawn_key ^= piece_keys[piece][to_square];
+		psqt_score -= piece_square_score[piece][to_square];
 
-		// reset occupancy
-		for (int bb_piece = P; bb_piece <= K; bb_piece++)
-			occupancy[white] |= board[bb_piece];
-		for (int bb_piece = p; bb_piece <= k; bb_piece++)
-			occupancy[black] |= board[bb_piece];
+		set_bit(board[promoted], to_square);
+		hash_key ^= piece_keys[promoted][to_square];
+		psqt_score += piece_square_score[promoted][to_square];
+	}
 
-		occupancy[both] |= occupancy[white];
-		occupancy[both] |= occupancy[black];
+	if (enpass)
+	{
+		int pawn_square = (side == white) ? to_square + 8 : to_square - 8;
+		int pawn = (side == white) ? p : P;
 
-		side ^= 1;
+		pop_bit(board[pawn], pawn_square);
+		occupancy[side ^ 1] ^= 1ULL << pawn_square;
+		piece_on[pawn_square] = no_piece;
 
-		hash_key ^= side_key;
+		hash_key ^= piece_keys[pawn][pawn_square];
+		pawn_key ^= piece_keys[pawn][pawn_square];
+		psqt_score -= piece_square_score[pawn][pawn_square];
+	}
 
-		if (is_square_attacked((side == white) ? get_lsb(board[k]) : get_lsb(board[K]), side))
+	if (nnue_feature_weights)
+	{
+		if (promoted)
 		{
-			take_back();
-			return 0;
+			nnue_remove(piece, from_square);
+			nnue_add(promoted, to_square);
 		}
 		else
-			return 1;
+			nnue_move(piece, from_square, to_square);
+
+		if (captured != no_piece)
+			nnue_remove(captured, to_square);
+
+		if (enpass)
+			nnue_remove((side == white) ? p : P, (side == white) ? to_square + 8 : to_square - 8);
 	}
-	else
+
+	if (enpassant != no_sqr)
+		hash_key ^= enpassant_keys[enpassant];
+
+	enpassant = no_sqr;
+
+	if (doublePush)
 	{
-		if (get_move_capture(move))
-			make_move(move, all_moves);
-		else
-			return 0;
+		enpassant = (side == white) ? to_square + 8 : to_square - 8;
+		hash_key ^= enpassant_keys[enpassant];
 	}
 
+	if (castling)
+		move_castling_rook(to_square);
+
+	hash_key ^= castle_keys[castle];
+
+	// update castling rights
+	castle &= castling_rights[from_square];
+	castle &= castling_rights[to_square];
+
+	hash_key ^= castle_keys[castle];
+
+	occupancy[both] = occupancy[white] | occupancy[black];
+
+	side ^= 1;
+
+	hash_key ^= side_key;
+
 }
 
-static inline void generate_moves(move_list* moves)
+// take back the last move made by make_move
+static inline void unmake_move()
 {
-	int from_square, to_square;
+	undo_info* undo = &undo_stack[--undo_count];
 
-	U64 bitboard, attacks;
+	int move = undo->move;
 
-	moves->count = 0;
+	int from_square = get_move_source(move);
+	int to_square = get_move_target(move);
+	int piece = get_move_piece(move);
+	int promoted = get_move_promoted(move);
 
-	for (int piece = P; piece <= k; piece++)
+	side ^= 1;
+
+	if (promoted)
 	{
-		bitboard = board[piece];
+		pop_bit(board[promoted], to_square);
+		set_bit(board[piece], to_square);
+	}
 
-		if (side == white)
-		{
-			if (piece == P)
-			{
-				while (bitboard)
-				{
-					from_square = get_lsb(bitboard);
-					to_square = from_square - 8;
-
-					// generate quiet pawn moves
-					if (!(to_square < a8) && !get_bit(occupancy[both], to_square))
-					{
-						// promotion
-						if (from_square >= a7 && from_square <= h7)
-						{
-							add_move(moves, encode_move(from_square, to_square, piece, Q, 0, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, R, 0, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, B, 0, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, N, 0, 0, 0, 0));
-						}
-						else
-						{
-							// single pawn push
-							add_move(moves, encode_move(from_square, to_square, piece, 0, 0, 0, 0, 0));
-
-							// double pawn push
-							if ((from_square >= a2 && from_square <= h2) && !get_bit(occupancy[both], to_square - 8))
-								add_move(moves, encode_move(from_square, to_square - 8, piece, 0, 0, 1, 0, 0));
-						}
-					}
-
-					attacks = pawn_attacks[side][from_square] & occupancy[black];
-
-					// generate pawn captures
-					while (attacks)
-					{
-						to_square = get_lsb(attacks);
-
-						if (from_square >= a7 && from_square <= h7)
-						{
-							add_move(moves, encode_move(from_square, to_square, piece, Q, 1, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, R, 1, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, B, 1, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, N, 1, 0, 0, 0));
-						}
-						else
-							add_move(moves, encode_move(from_square, to_square, piece, 0, 1, 0, 0, 0));
-
-						pop_bit(attacks, to_square);
-					}
-
-					// generate enpassant captures
-					if (enpassant != no_sqr)
-					{
-						U64 enpassant_attacks = pawn_attacks[side][from_square] & (1ULL << enpassant);
-
-						if (enpassant_attacks)
-						{
-							int target_enpassant = get_lsb(enpassant_attacks);
-							add_move(moves, encode_move(from_square, target_enpassant, piece, 0, 1, 0, 1, 0));
-						}
-					}
-
-					pop_bit(bitboard, from_square);
-				}
-			}
-			else if (piece == K)
-			{
-				if (castle & wk)
-				{
-					if (!get_bit(occupancy[both], f1) && !get_bit(occupancy[both], g1))
-					{
-						if (!is_square_attacked(e1, black) && !is_square_attacked(f1, black))
-							add_move(moves, encode_move(e1, g1, piece, 0, 0, 0, 0, 1));
-					}
-				}
-				else if (castle & wq)
-				{
-					if (!get_bit(occupancy[both], d1) && !get_bit(occupancy[both], c1) && !get_bit(occupancy[both], b1))
-					{
-						if (!is_square_attacked(e1, black) && !is_square_attacked(d1, black))
-							add_move(moves, encode_move(e1, c1, piece, 0, 0, 0, 0, 1));
-					}
-				}
-			}
-		}
-		else
-		{
-			if (piece == p)
-			{
-				while (bitboard)
-				{
-					from_square = get_lsb(bitboard);
-					to_square = from_square + 8;
-
-
-					// generate quiet pawn moves
-					if (!(to_square > h1) && !get_bit(occupancy[both], to_square))
-					{
-						if (from_square >= a2 && from_square <= h2)
-						{
-							add_move(moves, encode_move(from_square, to_square, piece, q, 0, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, r, 0, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, b, 0, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, n, 0, 0, 0, 0));
-						}
-						else
-						{
-							// generate single pawn pushes
-							add_move(moves, encode_move(from_square, to_square, piece, 0, 0, 0, 0, 0));
-
-							// generate double pawn pushes
-							if ((from_square >= a7 && from_square <= h7) && !get_bit(occupancy[both], to_square + 8))
-								add_move(moves, encode_move(from_square, to_square + 8, piece, 0, 0, 1, 0, 0));
-						}
-					}
-
-					attacks = pawn_attacks[side][from_square] & occupancy[white];
-
-					// generate pawn captures
-					while (attacks)
-					{
-						to_square = get_lsb(attacks);
-
-						if (from_square >= a2 && from_square <= h2)
-						{
-							add_move(moves, encode_move(from_square, to_square, piece, q, 1, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, r, 1, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, b, 1, 0, 0, 0));
-							add_move(moves, encode_move(from_square, to_square, piece, n, 1, 0, 0, 0));
-						}
-						else
-							add_move(moves, encode_move(from_square, to_square, piece, 0, 1, 0, 0, 0));
-
-						pop_bit(attacks, to_square);
-					}
-
-					// generate enpassant captures
-					if (enpassant != no_sqr)
-					{
-						U64 enpassant_attacks = pawn_attacks[side][from_square] & (1ULL << enpassant);
-
-						if (enpassant_attacks)
-						{
-							int target_enpassant = get_lsb(enpassant_attacks);
-							add_move(moves, encode_move(from_square, target_enpassant, piece, 0, 1, 0, 1, 0));
-						}
-					}
-
-					pop_bit(bitboard, from_square);
-				}
-			}
-			else if (piece == k)
-			{
-				if (castle & bk)
-				{
-					if (!get_bit(occupancy[both], f8) && !get_bit(occupancy[both], g8))
-					{
-						if (!is_square_attacked(e8, black) && !is_square_attacked(f8, black))
-							add_move(moves, encode_move(e8, g8, piece, 0, 0, 0, 0, 1));
-					}
-				}
-				else if (castle & bq)
-				{
-					if (!get_bit(occupancy[both], d8) && !get_bit(occupancy[both], c8) && !get_bit(occupancy[both], b8))
-					{
-						if (!is_square_attacked(e8, black) && !is_square_attacked(d8, black))
-						{
-							add_move(moves, encode_move(e8, c8, piece, 0, 0, 0, 0, 1));
-						}
-					}
-				}
-			}
-		}
+	U64 from_to = (1ULL << from_square) | (1ULL << to_square);
 
-		// generate knight moves
-		if ((side == white) ? piece == N : piece == n)
-		{
-			while (bitboard)
-			{
-				from_square = get_lsb(bitboard);
+	board[piece] ^= from_to;
+	occupancy[side] ^= from_to;
 
-				attacks = knight_attacks[from_square] & ((side == white) ? ~occupancy[white] : ~occupancy[black]);
+	piece_on[from_square] = piece;
+	piece_on[to_square] = undo->captured;
 
-				while (attacks)
-				{
-					to_square = get_lsb(attacks);
+	if (undo->captured != no_piece)
+	{
+		set_bit(board[undo->captured], to_square);
+		occupancy[side ^ 1] |= 1ULL << to_square;
+	}
 
-					// quiet moves
-					if (!get_bit(((side == white) ? occupancy[black] : occupancy[white]), to_square))
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 0, 0, 0, 0));
-					// capture moves
-					else
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 1, 0, 0, 0));
+	if (get_move_enpassant(move))
+	{
+		int pawn_square = (side == white) ? to_square + 8 : to_square - 8;
+		int pawn = (side == white) ? p : P;
 
-					pop_bit(attacks, to_square);
-				}
+		set_bit(board[pawn], pawn_square);
+		occupancy[side ^ 1] |= 1ULL << pawn_square;
+		piece_on[pawn_square] = pawn;
+	}
 
-				pop_bit(bitboard, from_square);
-			}
-		}
+	if (get_move_castling(move))
+		move_castling_rook(to_square);
 
-		// generate bishop moves
-		if ((side == white) ? piece == B : piece == b)
+	if (nnue_feature_weights)
+	{
+		if (promoted)
 		{
-			while (bitboard)
-			{
-				from_square = get_lsb(bitboard);
+			nnue_remove(promoted, to_square);
+			nnue_add(piece, from_square);
+		}
+		else
+			nnue_move(piece, to_square, from_square);
 
-				attacks = get_bishop_attacks(from_square, occupancy[both]) & ((side == white) ? ~occupancy[white] : ~occupancy[black]);
+		if (undo->captured != no_piece)
+			nnue_add(undo->captured, to_square);
 
-				while (attacks)
-				{
-					to_square = get_lsb(attacks);
+		if (get_move_enpassant(move))
+			nnue_add((side == white) ? p : P, (side == white) ? to_square + 8 : to_square - 8);
+	}
 
-					// quiet moves
-					if (!get_bit(((side == white) ? occupancy[black] : occupancy[white]), to_square))
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 0, 0, 0, 0));
-					// capture moves
-					else
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 1, 0, 0, 0));
+	occupancy[both] = occupancy[white] | occupancy[black];
 
-					pop_bit(attacks, to_square);
-				}
+	castle = undo->castle;
+	enpassant = undo->enpassant;
+	psqt_score = undo->psqt_score;
+	hash_key = undo->hash_key;
+	pawn_key = undo->pawn_key;
+}
 
-				pop_bit(bitboard, from_square);
-			}
-		}
+// pass the move to the opponent, used by null move pruning
+static inline void make_null_move()
+{
+	undo_info* undo = &undo_stack[undo_count++];
 
-		// generate rook moves
-		if ((side == white) ? piece == R : piece == r)
-		{
-			while (bitboard)
-			{
-				from_square = get_lsb(bitboard);
+	undo->move = 0;
+	undo->enpassant = enpassant;
+	undo->hash_key = hash_key;
 
-				attacks = get_rook_attacks(from_square, occupancy[both]) & ((side == white) ? ~occupancy[white] : ~occupancy[black]);
+	if (enpassant != no_sqr)
+		hash_key ^= enpassant_keys[enpassant];
 
-				while (attacks)
-				{
-					to_square = get_lsb(attacks);
+	enpassant = no_sqr;
 
-					// quiet moves
-					if (!get_bit(((side == white) ? occupancy[black] : occupancy[white]), to_square))
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 0, 0, 0, 0));
-					// capture moves
-					else
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 1, 0, 0, 0));
+	side ^= 1;
 
-					pop_bit(attacks, to_square);
-				}
-
-				pop_bit(bitboard, from_square);
-			}
-		}
-
-		// generate queen moves
-		if ((side == white) ? piece == Q : piece == q)
-		{
-			while (bitboard)
-			{
-				from_square = get_lsb(bitboard);
-
-				attacks = get_queen_attacks(from_square, occupancy[both]) & ((side == white) ? ~occupancy[white] : ~occupancy[black]);
-
-				while (attacks)
-				{
-					to_square = get_lsb(attacks);
+	hash_key ^= side_key;
+}
 
-					// quiet moves
-					if (!get_bit(((side == white) ? occupancy[black] : occupancy[white]), to_square))
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 0, 0, 0, 0));
-					// capture moves
-					else
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 1, 0, 0, 0));
+static inline void unmake_null_move()
+{
+	undo_info* undo = &undo_stack[--undo_count];
 
-					pop_bit(attacks, to_square);
-				}
+	side ^= 1;
 
-				pop_bit(bitboard, from_square);
-			}
-		}
+	enpassant = undo->enpassant;
+	hash_key = undo->hash_key;
+}
 
-		// generate king moves
-		if ((side == white) ? piece == K : piece == k)
-		{
-			while (bitboard)
-			{
-				from_square = get_lsb(bitboard);
+// everything legal move generation needs to know about the king of the side to move
+typedef struct {
+	int king_square;
+	U64 checkers;
+	U64 pinned;
+	// squares non-king moves must land on: anywhere, or block/capture a single checker
+	U64 check_mask;
+} check_info;
+
+static inline void init_check_info(check_info* info)
+{
+	int first_piece = (side == white) ? P : p;
+	int enemy_piece = (side == white) ? p : P;
 
-				attacks = king_attacks[from_square] & ((side == white) ? ~occupancy[white] : ~occupancy[black]);
+	info->king_square = get_lsb(board[first_piece + K]);
+	info->checkers = attackers_of(info->king_square, side ^ 1, occupancy[both]);
+	info->pinned = 0ULL;
 
-				while (attacks)
-				{
-					to_square = get_lsb(attacks);
+	// enemy sliders that would see the king if our own pieces were not there
+	U64 snipers = (get_bishop_attacks(info->king_square, occupancy[side ^ 1]) & (board[enemy_piece + B] | board[enemy_piece + Q])) |
+		(get_rook_attacks(info->king_square, occupancy[side ^ 1]) & (board[enemy_piece + R] | board[enemy_piece + Q]));
 
-					// quiet moves
-					if (!get_bit(((side == white) ? occupancy[black] : occupancy[white]), to_square))
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 0, 0, 0, 0));
-					// capture moves
-					else
-						add_move(moves, encode_move(from_square, to_square, piece, 0, 1, 0, 0, 0));
+	while (snipers)
+	{
+		int sniper = pop_lsb(&snipers);
 
-					pop_bit(attacks, to_square);
-				}
+		U64 blockers = between_squares[info->king_square][sniper] & occupancy[both];
 
-				pop_bit(bitboard, from_square);
-			}
-		}
+		// a single blocker of our own is pinned
+		if (blockers && !(blockers & (blockers - 1)) && (blockers & occupancy[side]))
+			info->pinned |= blockers;
 	}
-}
 
-long nodes;
+	if (!info->checkers)
+		info->check_mask = ~0ULL;
+	else if (info->checkers & (info->checkers - 1))
+		info->check_mask = 0ULL;
+	else
+		info->check_mask = info->checkers | between_squares[info->king_square][get_lsb(info->checkers)];
+}
 
-static inline void perft(int depth)
+// en passant removes two pawns from a rank, so test the resulting position directly
+static inline int is_enpassant_legal(int from_square, const check_info* info)
 {
-	if (depth == 0)
-	{
-		nodes++;
-		return;
-	}
-
-	move_list moves[1];
-
-	generate_moves(moves);
-
-	for (int i = 0; i < moves->count; i++)
-	{
-		int move = moves->moves[i];
+	int captured_square = (side == white) ? enpassant + 8 : enpassant - 8;
 
-		copy_board();
+	U64 blockers = (occupancy[both] ^ (1ULL << from_square) ^ (1ULL << captured_square)) | (1ULL << enpassant);
 
-		if (!make_move(move, all_moves))
-			continue;
+	int enemy_piece = (side == white) ? p : P;
 
-		perft(depth - 1);
+	U64 attackers = (get_bishop_attacks(info->king_square, blockers) & (board[enemy_piece + B] | board[enemy_piece + Q])) |
+		(get_rook_attacks(info->king_square, blockers) & (board[enemy_piece + R] | board[enemy_piece + Q])) |
+		(knight_attacks[info->king_square] & board[enemy_piece + N]) |
+		(pawn_attacks[side][info->king_square] & board[enemy_piece] & ~(1ULL << captured_square));
 
-		take_back();
-	}
+	return !attackers;
 }
 
-static inline void enable_pv_scoring(move_list* moves)
+// castling squares the king passes must be empty and safe
+static inline int can_castle(int right, U64 empty_path, U64 king_path, const check_info* info)
 {
-	follow_pv = 0;
+	if (!(castle & right) || info->checkers || (occupancy[both] & empty_path))
+		return 0;
 
-	for (int i = 0; i < moves->count; i++)
+	while (king_path)
 	{
-		// make sure we hit a pv move
-		if (pv_table[0][ply] == moves->moves[i])
-		{
-			score_pv = 1;
-			follow_pv = 1;
-		}
+		int square = pop_lsb(&king_path);
+
+		if (is_square_attacked(square, side ^ 1))
+			return 0;
 	}
+
+	return 1;
 }
 
-static inline int score_move(int move)
+// add pawn moves to every target square, coming from target + offset
+static inline void add_pawn_moves(move_list* moves, U64 targets, int offset, int piece, int capture, int double_push)
 {
-	if (score_pv)
+	while (targets)
 	{
-		if (pv_table[0][ply] == move)
+		int to_square = pop_lsb(&targets);
+		int from_square = to_square + offset;
+
+		if ((1ULL << to_square) & (rank_8 | rank_1))
 		{
-			score_pv = 0;
-			return 20000;
+			// promoted pieces follow the pawn in the piece enum
+			add_move(moves, encode_move(from_square, to_square, piece, piece + 4, capture, 0, 0, 0));
+			add_move(moves, encode_move(from_square, to_square, piece, piece + 3, capture, 0, 0, 0));
+			add_move(moves, encode_move(from_square, to_square, piece, piece + 2, capture, 0, 0, 0));
+			add_move(moves, encode_move(from_square, to_square, piece, piece + 1, capture, 0, 0, 0));
 		}
+		else
+			add_move(moves, encode_move(from_square, to_square, piece, 0, capture, double_push, 0, 0));
 	}
+}
 
-	if (get_move_capture(move))
-	{
-		int target_piece = P;
-		int start_piece, end_piece;
+// pawn pushes and captures of a set of pawns, limited to the allowed squares
+static inline void generate_pawn_moves(move_list* moves, U64 pawns, U64 allowed, int move_type)
+{
+	U64 enemy = occupancy[side ^ 1] & allowed;
+	U64 empty = ~occupancy[both];
 
-		if (side == white)
-		{
-			start_piece = p;
-			end_piece = k;
-		}
-		else
-		{
-			start_piece = P;
-			end_piece = K;
-		}
+	int pawn = (side == white) ? P : p;
 
-		for (int bb_piece = start_piece; bb_piece <= end_piece; bb_piece++)
-		{
-			if (get_bit(board[bb_piece], get_move_target(move)))
-			{
-				target_piece = bb_piece;
-				break;
-			}
-		}
+	U64 single, twice, left, right;
+	int push;
 
-		return mvv_lva[get_move_piece(move)][target_piece] + 10000;
+	if (side == white)
+	{
+		push = 8;
+		single = (pawns >> 8) & empty;
+		twice = ((single & 0xff0000000000ULL) >> 8) & empty & allowed;
+		left = (pawns >> 9) & not_H_file & enemy;
+		right = (pawns >> 7) & not_A_file & enemy;
 	}
 	else
 	{
-		if (killer_moves[0][ply] == move)
-			return 9000;
-		else if (killer_moves[1][ply] == move)
-			return 8000;
-		else
-			return history_moves[get_move_piece(move)][get_move_target(move)];
+		push = -8;
+		single = (pawns << 8) & empty;
+		twice = ((single & 0xff0000ULL) << 8) & empty & allowed;
+		left = (pawns << 7) & not_H_file & enemy;
+		right = (pawns << 9) & not_A_file & enemy;
 	}
-}
-
-static inline int sort_moves(move_list* moves)
-{
-	int move_scores[moves->count];
 
-	for (int i = 0; i < moves->count; i++)
-		move_scores[i] = score_move(moves->moves[i]);
+	single &= allowed;
 
-	for (int current = 0; current < moves->count; current++)
+	// promotions count as captures for move ordering and quiescence
+	if (move_type != only_quiets)
 	{
-		for (int next = current + 1; next < moves->count; next++)
-		{
-			if (move_scores[current] < move_scores[next])
-			{
-				int temp_score = move_scores[current];
-				move_scores[current] = move_scores[next];
-				move_scores[next] = temp_score;
+		add_pawn_moves(moves, single & (rank_8 | rank_1), push, pawn, 0, 0);
+		add_pawn_moves(moves, left, (side == white) ? 9 : -7, pawn, 1, 0);
+		add_pawn_moves(moves, right, (side == white) ? 7 : -9, pawn, 1, 0);
+	}
 
-				int temp_move = moves->moves[current];
-				moves->moves[current] = moves->moves[next];
-				moves->moves[next] = temp_move;
-			}
-		}
+	if (move_type != only_captures)
+	{
+		add_pawn_moves(moves, single & ~(rank_8 | rank_1), push, pawn, 0, 0);
+		add_pawn_moves(moves, twice, 2 * push, pawn, 0, 1);
 	}
 }
 
-static inline int evaluate()
+// legal moves of the requested type given the pins and checks of the position
+static inline void generate_legal_moves(move_list* moves, int move_type, const check_info* info)
 {
-	int score = 0;
+	int from_square, to_square;
 
-	U64 bitboard;
+	U64 bitboard, attacks;
+
+	// squares pieces may move to for the requested kind of moves
+	U64 targets;
 
-	int piece, square;
+	if (move_type == only_captures)
+		targets = occupancy[side ^ 1];
+	else if (move_type == only_quiets)
+		targets = ~occupancy[both];
+	else
+		targets = ~occupancy[side];
+
+	int pawn = (side == white) ? P : p;
+	int king = pawn + K;
+
+	moves->count = 0;
 
-	for (int bb_piece = P; bb_piece <= k; bb_piece++)
+	// only the king can answer a double check
+	if (!(info->checkers & (info->checkers - 1)))
 	{
-		bitboard = board[bb_piece];
+		// unpinned pawns go set-wise, pinned pawns one by one along their pin line
+		generate_pawn_moves(moves, board[pawn] & ~info->pinned, info->check_mask, move_type);
+
+		bitboard = board[pawn] & info->pinned;
 
 		while (bitboard)
 		{
-			piece = bb_piece;
-			square = get_lsb(bitboard);
+			from_square = pop_lsb(&bitboard);
+			generate_pawn_moves(moves, 1ULL << from_square, info->check_mask & line_squares[info->king_square][from_square], move_type);
+		}
 
-			score += material_score[piece];
+		if (enpassant != no_sqr && move_type != only_quiets)
+		{
+			// our pawns standing where an enemy pawn on the enpassant square would attack
+			bitboard = pawn_attacks[side ^ 1][enpassant] & board[pawn];
 
-			switch (piece)
+			while (bitboard)
 			{
-			case P:
-				score += pawn_score[square];
-				break;
-			case N:
-				score += knight_score[square];
-				break;
-			case B:
-				score += bishop_score[square];
-				break;
-			case R:
-				score += rook_score[square];
-				break;
-			case K:
-				score += king_score[square];
-				break;
+				from_square = pop_lsb(&bitboard);
 
-			case p:
-				score -= pawn_score[mirror_score[square]];
-				break;
-			case n:
-				score -= knight_score[mirror_score[square]];
-				break;
-			case b:
-				score -= bishop_score[mirror_score[square]];
-				break;
-			case r:
-				score -= rook_score[mirror_score[square]];
-				break;
-			case k:
-				score -= king_score[mirror_score[square]];
-				break;
+				if (is_enpassant_legal(from_square, info))
+					add_move(moves, encode_move(from_square, enpassant, pawn, 0, 1, 0, 1, 0));
 			}
-
-			pop_bit(bitboard, square);
 		}
-	}
-
-	return (side == white) ? score : -score;
-}
-
-static inline int is_repetition()
-{
-	for (int i = 0; i < rep_index; i++)
-	{
-		if (repetition_table[i] == hash_key)
-			return 1;
-	}
-	
-	return 0;
-}
-
-static inline int quiesce(int alpha, int beta)
-{
-	if ((nodes & 2047) == 0)
-		communicate();
-
-	nodes++;
 
-	int eval = evaluate();
+		// pinned knights can never move
+		for (int piece = pawn + N; piece <= pawn + Q; piece++)
+		{
+			bitboard = board[piece];
 
-	if (eval >= beta)
-		return beta;
+			if (piece == pawn + N)
+				bitboard &= ~info->pinned;
 
-	if (eval > alpha)
-		alpha = eval;
+			while (bitboard)
+			{
+				from_square = pop_lsb(&bitboard);
 
-	move_list moves[1];
+				switch (piece - pawn)
+				{
+				case N: attacks = knight_attacks[from_square]; break;
+				case B: attacks = get_bishop_attacks(from_square, occupancy[both]); break;
+				case R: attacks = get_rook_attacks(from_square, occupancy[both]); break;
+				default: attacks = get_queen_attacks(from_square, occupancy[both]); break;
+				}
 
-	generate_moves(moves);
+				attacks &= targets & info->check_mask;
 
-	sort_moves(moves);
+				if (get_bit(info->pinned, from_square))
+					attacks &= line_squares[info->king_square][from_square];
 
-	for (int i = 0; i < moves->count; i++)
-	{
-		copy_board();
-		ply++;
+				while (attacks)
+				{
+					to_square = pop_lsb(&attacks);
 
-		rep_index++;
-		repetition_table[rep_index] = hash_key;
+					int capture = get_bit(occupancy[side ^ 1], to_square) ? 1 : 0;
 
-		if (!make_move(moves->moves[i], only_captures))
-		{
-			ply--;
-			rep_index--;
-			continue;
+					add_move(moves, encode_move(from_square, to_square, piece, 0, capture, 0, 0, 0));
+				}
+			}
 		}
+	}
 
-		int score = -quiesce(-beta, -alpha);
+	// king steps, checked with the king lifted off the board so sliders see through it
+	U64 blockers = occupancy[both] ^ (1ULL << info->king_square);
 
-		ply--;
+	attacks = king_attacks[info->king_square] & targets;
 
-		rep_index--;
+	while (attacks)
+	{
+		to_square = pop_lsb(&attacks);
 
-		take_back();
+		int capture = get_bit(occupancy[side ^ 1], to_square) ? 1 : 0;
 
-		if (stopped) return 0;
+		if (!attackers_of(to_square, side ^ 1, blockers))
+			add_move(moves, encode_move(info->king_square, to_square, king, 0, capture, 0, 0, 0));
+	}
 
-		if (score > alpha)
+	if (move_type != only_captures)
+	{
+		if (side == white)
 		{
-			alpha = score;
+			if (can_castle(wk, (1ULL << f1) | (1ULL << g1), (1ULL << f1) | (1ULL << g1), info))
+				add_move(moves, encode_move(e1, g1, king, 0, 0, 0, 0, 1));
 
-			if (score >= beta)
-				return beta;
+			if (can_castle(wq, (1ULL << d1) | (1ULL << c1) | (1ULL << b1), (1ULL << d1) | (1ULL << c1), info))
+				add_move(moves, encode_move(e1, c1, king, 0, 0, 0, 0, 1));
 		}
-	}
+		else
+		{
+			if (can_castle(bk, (1ULL << f8) | (1ULL << g8), (1ULL << f8) | (1ULL << g8), info))
+				add_move(moves, encode_move(e8, g8, king, 0, 0, 0, 0, 1));
 
-	return alpha;
+			if (can_castle(bq, (1ULL << d8) | (1ULL << c8) | (1ULL << b8), (1ULL << d8) | (1ULL << c8), info))
+				add_move(moves, encode_move(e8, c8, king, 0, 0, 0, 0, 1));
+		}
+	}
 }
 
-static inline int negamax(int depth, int alpha, int beta)
+static inline void generate_moves(move_list* moves, int move_type)
 {
-	int hash_flag = hash_flag_alpha;
+	check_info info[1];
 
-	int score;
+	init_check_info(info);
 
-	int pv_node = beta - alpha > 1;
+	generate_legal_moves(moves, move_type, info);
+}
 
-	if (ply && is_repetition())
-		return 0;
+// captures and promotions only
+static inline void generate_captures(move_list* moves)
+{
+	generate_moves(moves, only_captures);
+}
 
-	if (ply && (score = read_tt_entry(depth, alpha, beta)) != no_hash_entry && !pv_node)
-		return score;
+// legality of a pseudo legal move, for moves that did not come from the generator
+static inline int is_legal(int move, const check_info* info)
+{
+	int from_square = get_move_source(move);
+	int to_square = get_move_target(move);
 
-	if ((nodes & 2047) == 0)
-		communicate();
+	if (from_square == info->king_square)
+	{
+		if (get_move_castling(move))
+			return !info->checkers && !is_square_attacked(to_square, side ^ 1);
 
-	pv_length[ply] = ply;
+		return !attackers_of(to_square, side ^ 1, occupancy[both] ^ (1ULL << from_square));
+	}
 
-	if (depth == 0)
-		return quiesce(alpha, beta);
+	if (get_move_enpassant(move))
+		return !(info->checkers & (info->checkers - 1)) && is_enpassant_legal(from_square, info);
 
-	if (ply > max_ply - 1)
-		return evaluate();
+	if (!get_bit(info->check_mask, to_square))
+		return 0;
 
-	nodes++;
+	return !get_bit(info->pinned, from_square) || get_bit(line_squares[info->king_square][from_square], to_square);
+}
 
-	int in_check = is_square_attacked((side == white) ? get_lsb(board[K]) : get_lsb(board[k]), side ^ 1);
+// perft hash entry, key is stored xored with the data like the main tt
+typedef struct {
+	U64 hash_key;
+	U64 data;
+} perft_entry;
 
-	if (in_check)
-		depth++;
+// optional perft hash table, sized by the UCI "PerftHash" option (0 = off)
+perft_entry* perft_table = NULL;
+U64 perft_entries = 0;
 
-	int legal_moves = 0;
+// pack leaf count and depth into a perft hash data word
+#define perft_pack(count, depth) (((U64)(count) << 8) | (U64)(depth))
 
-	// null move pruning
-	if (depth >= 3 && !in_check && ply)
-	{
-		copy_board();
-		ply++;
+static inline U64 perft(int depth)
+{
+	if (depth == 0)
+		return 1;
 
-		rep_index++;
-		repetition_table[rep_index] = hash_key;
+	perft_entry* entry = NULL;
 
-		if (enpassant != no_sqr) hash_key ^= enpassant_keys[enpassant];
+	if (perft_entries)
+	{
+		entry = &perft_table[mul_hi64(hash_key, perft_entries)];
 
-		// give black another move for more beta cutoffs
-		side ^= 1;
+		U64 data = entry->data;
 
-		hash_key ^= side_key;
+		if ((entry->hash_key ^ data) == hash_key && (int)(data & 0xff) == depth)
+			return data >> 8;
+	}
 
-		if (enpassant != no_sqr) hash_key ^= enpassant_keys[enpassant];
-		enpassant = no_sqr;
+	U64 count = 0;
 
-		// search moves with a reduced depth
-		score = -negamax(depth - 1 - 2, -beta, -beta + 1);
+	move_list moves[1];
 
-		ply--;
-		rep_index--;
+	generate_moves(moves, all_moves);
 
-		take_back();
+	// every generated move is legal, so the last ply is just the move count
+	if (depth == 1)
+		count = moves->count;
+	else
+	{
+		for (int i = 0; i < moves->count; i++)
+		{
+			make_move(moves->moves[i]);
 
-		if (stopped)
-			return 0;
+			count += perft(depth - 1);
 
-		if (score >= beta)
-			return beta;
+			unmake_move();
+		}
 	}
 
-	move_list moves[1];
+	if (entry)
+	{
+		U64 data = perft_pack(count, depth);
 
-	generate_moves(moves);
+		entry->hash_key = hash_key ^ data;
+		entry->data = data;
+	}
 
-	if (follow_pv)
-		enable_pv_scoring(moves);
+	return count;
+}
 
-	sort_moves(moves);
+// piece standing on the target square of a capture
+static inline int captured_piece(int move)
+{
+	if (get_move_enpassant(move))
+		return (side == white) ? p : P;
 
-	int moves_searched = 0;
+	return piece_on[get_move_target(move)];
+}
 
-	for (int i = 0; i < moves->count; i++)
+static inline int score_move(int move)
+{
+	if (get_move_capture(move))
+		return mvv_lva[get_move_piece(move)][captured_piece(move)] + 10000;
+	else if (get_move_promoted(move))
+		return 10000;
+	else
 	{
-		copy_board();
-		ply++;
-
-		rep_index++;
-		repetition_table[rep_index] = hash_key;
+		if (killer_moves[0][ply] == move)
+			return 9000;
+		else if (killer_moves[1][ply] == move)
+			return 8000;
+		else
+			return history_moves[get_move_piece(move)][get_move_target(move)];
+	}
+}
 
-		if (!make_move(moves->moves[i], all_moves))
-		{
-			ply--;
-			rep_index--;
+static inline void score_moves(move_list* moves)
+{
+	for (int i = 0; i < moves->count; i++)
+		moves->scores[i] = score_move(moves->moves[i]);
+}
+
+// swap the best scored of the remaining moves into place, so only searched moves get sorted
+static inline int pick_move(move_list* moves, int current)
+{
+	int best = current;
+
+	for (int next = current + 1; next < moves->count; next++)
+	{
+		if (moves->scores[next] > moves->scores[best])
+			best = next;
+	}
+
+	int best_move = moves->moves[best];
+	int best_score = moves->scores[best];
+
+	moves->moves[best] = moves->moves[current];
+	moves->scores[best] = moves->scores[current];
+
+	moves->moves[current] = best_move;
+	moves->scores[current] = best_score;
+
+	return best_move;
+}
+
+// check that a move from the hash table or killer slots can be played here
+static inline int is_pseudo_legal(int move)
+{
+	if (!move)
+		return 0;
+
+	int from_square = get_move_source(move);
+	int to_square = get_move_target(move);
+	int piece = get_move_piece(move);
+	int promoted = get_move_promoted(move);
+
+	int first_piece = (side == white) ? P : p;
+
+	if (piece < first_piece || piece > first_piece + 5)
+		return 0;
+
+	if (piece_on[from_square] != piece || get_bit(occupancy[side], to_square))
+		return 0;
+
+	if (get_move_castling(move))
+	{
+		if (side == white)
+		{
+			if (move == encode_move(e1, g1, K, 0, 0, 0, 0, 1))
+				return (castle & wk) && !get_bit(occupancy[both], f1) && !get_bit(occupancy[both], g1) &&
+					!is_square_attacked(e1, black) && !is_square_attacked(f1, black);
+
+			if (move == encode_move(e1, c1, K, 0, 0, 0, 0, 1))
+				return (castle & wq) && !get_bit(occupancy[both], d1) && !get_bit(occupancy[both], c1) && !get_bit(occupancy[both], b1) &&
+					!is_square_attacked(e1, black) && !is_square_attacked(d1, black);
+		}
+		else
+		{
+			if (move == encode_move(e8, g8, k, 0, 0, 0, 0, 1))
+				return (castle & bk) && !get_bit(occupancy[both], f8) && !get_bit(occupancy[both], g8) &&
+					!is_square_attacked(e8, white) && !is_square_attacked(f8, white);
+
+			if (move == encode_move(e8, c8, k, 0, 0, 0, 0, 1))
+				return (castle & bq) && !get_bit(occupancy[both], d8) && !get_bit(occupancy[both], c8) && !get_bit(occupancy[both], b8) &&
+					!is_square_attacked(e8, white) && !is_square_attacked(d8, white);
+		}
+
+		return 0;
+	}
+
+	if (get_move_enpassant(move))
+		return piece == first_piece && to_square == enpassant && get_move_capture(move) && !promoted &&
+			!get_move_double(move) && get_bit(pawn_attacks[side][from_square], to_square);
+
+	// capture flag has to match the target square
+	if (!get_move_capture(move) != !get_bit(occupancy[side ^ 1], to_square))
+		return 0;
+
+	if (piece == first_piece)
+	{
+		int last_rank = (side == white) ? (to_square <= h8) : (to_square >= a1);
+
+		if (last_rank != (promoted != 0))
+			return 0;
+
+		if (promoted && (promoted <= first_piece || promoted >= first_piece + 5))
+			return 0;
+
+		if (get_move_capture(move))
+			return !get_move_double(move) && get_bit(pawn_attacks[side][from_square], to_square);
+
+		int push = (side == white) ? -8 : 8;
+
+		if (get_bit(occupancy[both], (from_square + push)))
+			return 0;
+
+		if (get_move_double(move))
+		{
+			int start_rank = (side == white) ? (from_square >= a2 && from_square <= h2) : (from_square >= a7 && from_square <= h7);
+
+			return start_rank && to_square == from_square + 2 * push && !get_bit(occupancy[both], to_square);
+		}
+
+		return to_square == from_square + push;
+	}
+
+	if (promoted || get_move_double(move))
+		return 0;
+
+	U64 attacks;
+
+	switch (piece - first_piece)
+	{
+	case N: attacks = knight_attacks[from_square]; break;
+	case B: attacks = get_bishop_attacks(from_square, occupancy[both]); break;
+	case R: attacks = get_rook_attacks(from_square, occupancy[both]); break;
+	case Q: attacks = get_queen_attacks(from_square, occupancy[both]); break;
+	default: attacks = king_attacks[from_square]; break;
+	}
+
+	return get_bit(attacks, to_square) != 0;
+}
+
+// static exchange evaluation: material won by the capture sequence on the target square,
+// both sides recapturing with their least valuable attacker and free to stop
+static inline int see(int move)
+{
+	int to_square = get_move_target(move);
+	int piece = get_move_piece(move);
+	int promoted = get_move_promoted(move);
+
+	int gain[32];
+	int depth = 0;
+
+	U64 occupied = occupancy[both];
+	U64 from_bit = 1ULL << get_move_source(move);
+
+	U64 diagonal = board[B] | board[b] | board[Q] | board[q];
+	U64 straight = board[R] | board[r] | board[Q] | board[q];
+
+	gain[0] = get_move_capture(move) ? abs(material_score[captured_piece(move)]) : 0;
+
+	// the captured pawn of an en passant is not on the target square
+	if (get_move_enpassant(move))
+		occupied ^= 1ULL << ((side == white) ? to_square + 8 : to_square - 8);
+
+	// a promoting pawn stands on the square as the new piece
+	if (promoted)
+	{
+		gain[0] += abs(material_score[promoted]) - abs(material_score[piece]);
+		piece = promoted;
+	}
+
+	U64 attackers = attackers_of(to_square, white, occupied) | attackers_of(to_square, black, occupied);
+
+	int stm = side;
+
+	do
+	{
+		depth++;
+
+		// speculative score if the piece just moved gets captured
+		gain[depth] = abs(material_score[piece]) - gain[depth - 1];
+
+		// neither side can improve by continuing
+		if ((-gain[depth - 1] > gain[depth] ? -gain[depth - 1] : gain[depth]) < 0)
+			break;
+
+		occupied ^= from_bit;
+
+		// sliders behind the piece that moved join in
+		attackers |= (get_bishop_attacks(to_square, occupied) & diagonal) | (get_rook_attacks(to_square, occupied) & straight);
+		attackers &= occupied;
+
+		stm ^= 1;
+		from_bit = 0;
+
+		int first_piece = (stm == white) ? P : p;
+
+		for (int next = first_piece; next <= first_piece + K; next++)
+		{
+			U64 subset = attackers & board[next];
+
+			if (subset)
+			{
+				from_bit = subset & -subset;
+				piece = next;
+				break;
+			}
+		}
+	}
+	while (from_bit && depth < 31);
+
+	while (--depth)
+		gain[depth - 1] = -(-gain[depth - 1] > gain[depth] ? -gain[depth - 1] : gain[depth]);
+
+	return gain[0];
+}
+
+// captures that don't lose material, taking a piece worth at least the capturer always qualifies
+static inline int is_good_capture(int move)
+{
+	if (get_move_capture(move) && !get_move_promoted(move) &&
+		abs(material_score[captured_piece(move)]) >= abs(material_score[get_move_piece(move)]))
+		return 1;
+
+	return see(move) >= 0;
+}
+
+// move picker stages, each one generated only once the previous one is used up
+enum {
+	stage_pv,
+	stage_hash,
+	stage_init_captures,
+	stage_good_captures,
+	stage_killers,
+	stage_init_quiets,
+	stage_quiets,
+	stage_bad_captures,
+	stage_done
+};
+
+typedef struct {
+	check_info info[1];
+	int stage;
+	int pv_move;
+	int hash_move;
+	int killer;
+	int current;
+	int bad_count;
+	int bad_current;
+	int bad_captures[256];
+	move_list moves[1];
+} move_picker;
+
+// hash, killer and PV moves are not generated and have to be checked against the board
+static inline int is_playable(move_picker* picker, int move)
+{
+	return is_pseudo_legal(move) && is_legal(move, picker->info);
+}
+
+static inline void init_picker(move_picker* picker, int hash_move)
+{
+	init_check_info(picker->info);
+
+	picker->stage = stage_pv;
+	picker->pv_move = 0;
+	picker->hash_move = hash_move;
+	picker->killer = 0;
+	picker->bad_count = 0;
+	picker->bad_current = 0;
+}
+
+// PV and hash moves are played before any list is generated
+static inline int is_picked_early(move_picker* picker, int move)
+{
+	return move == picker->pv_move || move == picker->hash_move;
+}
+
+// next legal move to search, 0 when the node is exhausted
+static inline int next_move(move_picker* picker)
+{
+	int move;
+
+	switch (picker->stage)
+	{
+	case stage_pv:
+		picker->stage++;
+
+		// the PV move has already been checked by the caller
+		if (picker->pv_move)
+			return picker->pv_move;
+
+		/* fall through */
+	case stage_hash:
+		picker->stage++;
+
+		if (picker->hash_move != picker->pv_move && is_playable(picker, picker->hash_move))
+			return picker->hash_move;
+
+		picker->hash_move = 0;
+
+		/* fall through */
+	case stage_init_captures:
+		generate_legal_moves(picker->moves, only_captures, picker->info);
+		score_moves(picker->moves);
+
+		picker->current = 0;
+		picker->stage++;
+
+		/* fall through */
+	case stage_good_captures:
+		while (picker->current < picker->moves->count)
+		{
+			move = pick_move(picker->moves, picker->current++);
+
+			if (is_picked_early(picker, move))
+				continue;
+
+			// search losing captures after the quiet moves
+			if (!is_good_capture(move))
+			{
+				picker->bad_captures[picker->bad_count++] = move;
+				continue;
+			}
+
+			return move;
+		}
+
+		picker->stage++;
+
+		/* fall through */
+	case stage_killers:
+		while (picker->killer < 2)
+		{
+			move = killer_moves[picker->killer++][ply];
+
+			if (picker->killer == 2 && move == killer_moves[0][ply])
+				continue;
+
+			// promotions were already played with the captures
+			if (!is_picked_early(picker, move) && !get_move_capture(move) && !get_move_promoted(move) && is_playable(picker, move))
+				return move;
+		}
+
+		picker->stage++;
+
+		/* fall through */
+	case stage_init_quiets:
+		generate_legal_moves(picker->moves, only_quiets, picker->info);
+		score_moves(picker->moves);
+
+		picker->current = 0;
+		picker->stage++;
+
+		/* fall through */
+	case stage_quiets:
+		while (picker->current < picker->moves->count)
+		{
+			move = pick_move(picker->moves, picker->current++);
+
+			if (is_picked_early(picker, move) || move == killer_moves[0][ply] || move == killer_moves[1][ply])
+				continue;
+
+			return move;
+		}
+
+		picker->stage++;
+
+		/* fall through */
+	case stage_bad_captures:
+		if (picker->bad_current < picker->bad_count)
+			return picker->bad_captures[picker->bad_current++];
+
+		picker->stage++;
+	}
+
+	return 0;
+}
+
+// doubled, isolated, backward and passed pawns of one side
+int evaluate_pawns(int color)
+{
+	U64 pawns = board[(color == white) ? P : p];
+	U64 enemy_pawns = board[(color == white) ? p : P];
+
+	int score = 0;
+
+	for (int file = 0; file < 8; file++)
+	{
+		int count = count_bits(pawns & file_masks[file]);
+
+		if (count > 1)
+			score += doubled_pawn_penalty * (count - 1);
+	}
+
+	U64 bitboard = pawns;
+
+	while (bitboard)
+	{
+		int square = pop_lsb(&bitboard);
+		int file = square & 7;
+
+		if (!(pawns & adjacent_files_masks[file]))
+			score += isolated_pawn_penalty;
+
+		// no pawn can come up to defend it and an enemy pawn guards its stop square
+		else if (!(pawns & support_masks[color][square]) &&
+			(pawn_attacks[color][(color == white) ? square - 8 : square + 8] & enemy_pawns))
+			score += backward_pawn_penalty;
+
+		if (!(enemy_pawns & passed_masks[color][square]))
+			score += passed_pawn_bonus[(color == white) ? 7 - (square >> 3) : square >> 3];
+	}
+
+	return score;
+}
+
+// pawn structure entries, one table per thread so probing needs no locking
+#define pawn_table_size 16384
+
+typedef struct {
+	U64 pawn_key;
+	int score;
+} pawn_entry;
+
+per_thread pawn_entry pawn_table[pawn_table_size];
+
+// pawn structure score from white's point of view, cached by pawn key
+static inline int pawn_structure_score()
+{
+	pawn_entry* entry = &pawn_table[pawn_key & (pawn_table_size - 1)];
+
+	stat_inc(pawn_probes);
+
+	// the empty entry matches the pawnless key 0, which scores 0 as well
+	if (entry->pawn_key == pawn_key)
+	{
+		stat_inc(pawn_hits);
+		return entry->score;
+	}
+
+	entry->pawn_key = pawn_key;
+	entry->score = evaluate_pawns(white) - evaluate_pawns(black);
+
+	return entry->score;
+}
+
+// static evals shared by all threads, written lock-free like the transposition table
+#define eval_cache_size 65536
+
+typedef struct {
+	U64 hash_key;
+	U64 data;
+} eval_entry;
+
+eval_entry eval_cache[eval_cache_size];
+
+void clear_eval_cache()
+{
+	memset(eval_cache, 0, sizeof(eval_cache));
+}
+
+static inline int evaluate()
+{
+#ifdef DEBUG
+	assert(psqt_score == compute_psqt_score());
+	assert(pawn_key == generate_pawn_key());
+
+	if (nnue_feature_weights)
+	{
+		short updated[2][nnue_hidden];
+		memcpy(updated, accumulator, sizeof(updated));
+
+		nnue_refresh();
+		assert(memcmp(updated, accumulator, sizeof(updated)) == 0);
+	}
+#endif
+
+	eval_entry* entry = &eval_cache[hash_key & (eval_cache_size - 1)];
+
+	U64 data = entry->data;
+
+	stat_inc(eval_probes);
+
+	if ((entry->hash_key ^ data) == hash_key)
+	{
+		stat_inc(eval_hits);
+		return (int)data;
+	}
+
+	int score;
+
+	if (nnue_feature_weights)
+		score = nnue_evaluate();
+	else
+	{
+		// material and positional score is kept up to date by make_move
+		score = psqt_score + pawn_structure_score();
+
+		if (side == black)
+			score = -score;
+	}
+
+	data = (unsigned int)score;
+
+	entry->hash_key = hash_key ^ data;
+	entry->data = data;
+
+	return score;
+}
+
+static inline int is_repetition()
+{
+	for (int i = 0; i < rep_index; i++)
+	{
+		if (repetition_table[i] == hash_key)
+			return 1;
+	}
+	
+	return 0;
+}
+
+static inline int quiesce(int alpha, int beta)
+{
+	if ((nodes & 1023) == 0)
+		communicate();
+
+	nodes++;
+	stat_inc(quiescence_nodes);
+
+	if (ply > seldepth)
+		seldepth = ply;
+
+	int eval = evaluate();
+
+	// per ply tables end at max ply
+	if (ply > max_ply - 1)
+		return eval;
+
+	if (eval >= beta)
+		return beta;
+
+	if (eval > alpha)
+		alpha = eval;
+
+	move_list moves[1];
+
+	generate_captures(moves);
+
+	score_moves(moves);
+
+	for (int i = 0; i < moves->count; i++)
+	{
+		int move = pick_move(moves, i);
+
+		// delta pruning: even winning the piece outright stays below alpha
+		if (!get_move_promoted(move) && eval + abs(material_score[captured_piece(move)]) + delta_margin <= alpha)
+			continue;
+
+		// captures that lose material can't raise alpha over the stand pat
+		if (!is_good_capture(move))
+			continue;
+
+		ply++;
+
+		rep_index++;
+		repetition_table[rep_index] = hash_key;
+
+		make_move(move);
+
+		int score = -quiesce(-beta, -alpha);
+
+		ply--;
+
+		rep_index--;
+
+		unmake_move();
+
+		if (stopped) return 0;
+
+		if (score > alpha)
+		{
+			alpha = score;
+
+			if (score >= beta)
+				return beta;
+		}
+	}
+
+	return alpha;
+}
+
+static inline int negamax(int depth, int alpha, int beta)
+{
+	int hash_flag = hash_flag_alpha;
+
+	int score;
+
+	int pv_node = beta - alpha > 1;
+
+	// best move from the transposition table, searched first
+	int hash_move = 0;
+
+	// best move found at this node, stored back in the transposition table
+	int best_move = 0;
+
+	if (ply && is_repetition())
+		return 0;
+
+	score = read_tt_entry(depth, alpha, beta, &hash_move);
+
+	if (ply && score != no_hash_entry && !pv_node)
+	{
+		stat_inc(tt_cutoffs);
+		return score;
+	}
+
+	if ((nodes & 1023) == 0)
+		communicate();
+
+	pv_length[ply] = ply;
+
+	if (depth == 0)
+		return quiesce(alpha, beta);
+
+	if (ply > max_ply - 1)
+		return evaluate();
+
+	nodes++;
+	stat_inc(main_nodes);
+
+	if (ply > seldepth)
+		seldepth = ply;
+
+	int in_check = is_square_attacked((side == white) ? get_lsb(board[K]) : get_lsb(board[k]), side ^ 1);
+
+	if (in_check)
+		depth++;
+
+	int legal_moves = 0;
+
+	// static eval based pruning, away from the PV, checks and mate scores
+	int prune_node = ply && !pv_node && !in_check && alpha > -mate_score && beta < mate_score;
+
+	int static_eval = prune_node ? evaluate() : 0;
+
+	// reverse futility: too far above beta for the opponent to catch up
+	if (prune_node && depth <= rfp_depth && static_eval - rfp_margin * depth >= beta)
+		return beta;
+
+	// razoring: far below alpha, see if captures alone can get back
+	if (prune_node && depth <= razor_depth && static_eval + razor_margin * depth < alpha)
+	{
+		score = quiesce(alpha, beta);
+
+		if (stopped)
+			return 0;
+
+		if (score <= alpha)
+			return alpha;
+	}
+
+	// quiet moves near the leaves that can't lift the score to alpha are skipped
+	int futile = prune_node && depth <= futility_depth && static_eval + futility_margin * depth <= alpha;
+
+	// late move pruning: after enough quiet moves the rest rarely matter
+	int quiet_limit = (prune_node && depth <= lmp_depth) ? lmp_base + depth * depth : 256;
+	int quiets_searched = 0;
+
+	// null move pruning
+	if (depth >= 3 && !in_check && ply)
+	{
+		ply++;
+
+		rep_index++;
+		repetition_table[rep_index] = hash_key;
+
+		// give the opponent another move for more beta cutoffs
+		make_null_move();
+
+		stat_inc(null_tries);
+
+		// search moves with a reduced depth
+		score = -negamax(depth - 1 - 2, -beta, -beta + 1);
+
+		ply--;
+		rep_index--;
+
+		unmake_null_move();
+
+		if (stopped)
+			return 0;
+
+		if (score >= beta)
+		{
+			stat_inc(null_cutoffs);
+			return beta;
+		}
+	}
+
+	move_picker picker[1];
+
+	init_picker(picker, hash_move);
+
+	// keep following the PV of the last iteration while it is playable here
+	if (follow_pv)
+	{
+		follow_pv = 0;
+
+		if (is_playable(picker, pv_table[0][ply]))
+		{
+			picker->pv_move = pv_table[0][ply];
+			follow_pv = 1;
+		}
+	}
+
+	int moves_searched = 0;
+
+	int move;
+
+	while ((move = next_move(picker)))
+	{
+		ply++;
+
+		rep_index++;
+		repetition_table[rep_index] = hash_key;
+
+		make_move(move);
+
+		legal_moves++;
+
+		if (!get_move_capture(move) && !get_move_promoted(move))
+		{
+			// moves giving check are never pruned
+			if (moves_searched && (futile || quiets_searched >= quiet_limit) &&
+				!is_square_attacked((side == white) ? get_lsb(board[K]) : get_lsb(board[k]), side ^ 1))
+			{
+				ply--;
+				rep_index--;
+
+				unmake_move();
+
+				continue;
+			}
+
+			quiets_searched++;
+		}
+
+		// PVS or principal variation search
+		if (moves_searched == 0)
+			score = -negamax(depth - 1, -beta, -alpha);
+		else
+		{
+			// LMR or late move reduction
+			if (moves_searched >= full_depth_moves && depth >= reduction_limit && in_check == 0 && !get_move_capture(move) && !get_move_promoted(move))
+			{
+				stat_inc(lmr_searches);
+
+				score = -negamax(depth - 2, -alpha - 1, -alpha);
+
+				if (score > alpha)
+					stat_inc(lmr_researches);
+			}
+			else
+				score = alpha + 1;
+
+			if (score > alpha)
+			{
+				score = -negamax(depth - 1, -alpha - 1, -alpha);
+
+				if ((score > alpha) && (score < beta))
+					// if LMR fails research at full depth
+					score = -negamax(depth - 1, -beta, -alpha);
+			}
+		}
+
+		ply--;
+		rep_index--;
+
+		unmake_move();
+
+		if (stopped)
+			return 0;
+
+		moves_searched++;
+
+		if (score > alpha)
+		{
+			hash_flag = hash_flag_exact;
+
+			if (!get_move_capture(move))
+				history_moves[get_move_piece(move)][get_move_target(move)] += depth;
+
+			alpha = score;
+
+			best_move = move;
+
+			pv_table[ply][ply] = move;
+
+			for (int next_ply = ply + 1; next_ply < pv_length[ply + 1]; next_ply++)
+				pv_table[ply][next_ply] = pv_table[ply + 1][next_ply];
+
+			pv_length[ply] = pv_length[ply + 1];
+
+			if (score >= beta)
+			{
+				stat_inc(fail_highs);
+
+				if (moves_searched == 1)
+					stat_inc(fail_highs_first);
+
+				write_tt_entry(depth, beta, hash_flag_beta, best_move);
+
+				if (!get_move_capture(move) && move != killer_moves[0][ply])
+				{
+					killer_moves[1][ply] = killer_moves[0][ply];
+					killer_moves[0][ply] = move;
+				}
+
+				return beta;
+			}
+		}
+	}
+
+	if (legal_moves == 0)
+	{
+		if (in_check)
+			return -mate_value + ply;
+		else
+			return 0;
+	}
+
+	write_tt_entry(depth, alpha, hash_flag, best_move);
+
+	return alpha;
+}
+
+// root position and depth handed to the helper threads
+position root_position;
+int root_depth;
+
+void save_position(position* pos)
+{
+	memcpy(pos->board, board, sizeof(board));
+	memcpy(pos->occupancy, occupancy, sizeof(occupancy));
+	memcpy(pos->piece_on, piece_on, sizeof(piece_on));
+	memcpy(pos->repetition_table, repetition_table, sizeof(repetition_table));
+
+	pos->hash_key = hash_key;
+	pos->pawn_key = pawn_key;
+	pos->rep_index = rep_index;
+	pos->side = side;
+	pos->enpassant = enpassant;
+	pos->castle = castle;
+	pos->psqt_score = psqt_score;
+}
+
+void restore_position(const position* pos)
+{
+	memcpy(board, pos->board, sizeof(board));
+	memcpy(occupancy, pos->occupancy, sizeof(occupancy));
+	memcpy(piece_on, pos->piece_on, sizeof(piece_on));
+	memcpy(repetition_table, pos->repetition_table, sizeof(repetition_table));
+
+	hash_key = pos->hash_key;
+	pawn_key = pos->pawn_key;
+	rep_index = pos->rep_index;
+	side = pos->side;
+	enpassant = pos->enpassant;
+	castle = pos->castle;
+	psqt_score = pos->psqt_score;
+
+	nnue_refresh();
+
+	ply = 0;
+	undo_count = 0;
+}
+
+// sum of the nodes searched by all threads
+long total_nodes()
+{
+	long sum = 0;
+
+	// the caller's own count is exact, not the last one it published
+	atomic_store_explicit(&thread_nodes[thread_id], nodes, memory_order_relaxed);
+
+	for (int i = 0; i < thread_count; i++)
+		sum += atomic_load_explicit(&thread_nodes[i], memory_order_relaxed);
+
+	return sum;
+}
+
+// permille of the table in use, sampled from the first thousand entries
+int hash_full()
+{
+	int used = 0;
+
+	for (U64 i = 0; i < 1000 && i < hash_entries; i++)
+		used += transpos_table[i].data != 0;
+
+	return used;
+}
+
+#ifdef SEARCH_STATS
+// percentage of part in total, 0 when nothing was counted
+static double percent(U64 part, U64 total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+// counters of the main thread since the search started
+void print_search_stats()
+{
+	printf("info string tt probes %llu hits %llu (%.1f%%) cutoffs %llu (%.1f%%)\n",
+		stats.tt_probes, stats.tt_hits, percent(stats.tt_hits, stats.tt_probes),
+		stats.tt_cutoffs, percent(stats.tt_cutoffs, stats.tt_probes));
+
+	printf("info string fail highs %llu first move %llu (%.1f%%)\n",
+		stats.fail_highs, stats.fail_highs_first, percent(stats.fail_highs_first, stats.fail_highs));
+
+	printf("info string null move tries %llu cutoffs %llu (%.1f%%) lmr searches %llu re-searches %llu (%.1f%%)\n",
+		stats.null_tries, stats.null_cutoffs, percent(stats.null_cutoffs, stats.null_tries),
+		stats.lmr_searches, stats.lmr_researches, percent(stats.lmr_researches, stats.lmr_searches));
+
+	printf("info string nodes main %llu quiescence %llu (%.1f%%)\n",
+		stats.main_nodes, stats.quiescence_nodes, percent(stats.quiescence_nodes, stats.main_nodes + stats.quiescence_nodes));
+
+	printf("info string eval cache probes %llu hits %llu (%.1f%%) pawn hash probes %llu hits %llu (%.1f%%)\n",
+		stats.eval_probes, stats.eval_hits, percent(stats.eval_hits, stats.eval_probes),
+		stats.pawn_probes, stats.pawn_hits, percent(stats.pawn_hits, stats.pawn_probes));
+}
+#endif
+
+// best move of the last completed iteration of the main thread and the expected reply
+int root_best_move;
+int root_ponder_move;
+
+// iterative deepening, run by the main thread and every helper thread
+static void search_position(int depth)
+{
+	follow_pv = 0;
+
+	memset(killer_moves, 0, sizeof(killer_moves));
+	memset(history_moves, 0, sizeof(history_moves));
+	memset(pv_table, 0, sizeof(pv_table));
+	memset(pv_length, 0, sizeof(pv_length));
+
+	seldepth = 0;
+
+#ifdef SEARCH_STATS
+	memset(&stats, 0, sizeof(stats));
+#endif
+
+	int alpha = -INF;
+	int beta = INF;
+	int score = 0;
+
+	// durations of the last two completed iterations (us)
+	long long last_iteration = 0;
+	long long previous_iteration = 0;
+
+	long long iteration_start = get_time_us();
+
+	// odd helpers skip the first iteration so threads desynchronise on depth
+	for (int current_depth = 1 + (thread_id & 1); current_depth <= depth; current_depth++)
+	{
+		if (stopped)
+			break;
+
+		follow_pv = 1;
+
+		score = negamax(current_depth, alpha, beta);
+
+		// an interrupted iteration is thrown away
+		if (stopped)
+			break;
+
+		// we went outside the window 
+		if ((score <= alpha) || (score >= beta))
+		{
+			// research with normal alpha and beta
+			alpha = -INF;
+			beta = INF;
 			continue;
 		}
 
-		legal_moves++;
+		// setup aspiration window for next iteration, narrowing the scope for each ply
+		alpha = score - 50;
+		beta = score + 50;
+
+		// only the main thread reports to the GUI
+		if (thread_id)
+			continue;
+
+		root_best_move = pv_table[0][0];
+		root_ponder_move = (pv_length[0] > 1) ? pv_table[0][1] : 0;
+
+		long long now = get_time_us();
+
+		long searched = total_nodes();
+		int time = (int)((now - starttime) / 1000);
+		long nps = searched * 1000 / (time + 1);
+
+		pthread_mutex_lock(&io_lock);
+
+		if (score > -mate_value && score < -mate_score)
+			printf("info score mate %d", -(score + mate_score));
+		else if (score > mate_score && score < mate_value)
+			printf("info score mate %d", (mate_score - score));
+		else
+			printf("info score cp %d", score);
+
+		printf(" depth %d seldepth %d nodes %ld nps %ld hashfull %d time %d pv ", current_depth, seldepth, searched, nps, hash_full(), time);
+
+		for (int i = 0; i < pv_length[0]; i++)
+		{
+			print_move(pv_table[0][i]);
+			printf(" ");
+		}
+
+		printf("\n");
+
+#ifdef SEARCH_STATS
+		print_search_stats();
+#endif
+
+		pthread_mutex_unlock(&io_lock);
+
+		// timed while pondering too, so the first iterations after ponderhit predict from real durations
+		previous_iteration = last_iteration;
+		last_iteration = now - iteration_start;
+		iteration_start = now;
+
+		if (!timeset || pondering)
+			continue;
+
+		// each depth costs a few times the previous one, estimate how many from the last two
+		long long growth = previous_iteration ? last_iteration / (previous_iteration + 1) : 2;
+
+		if (growth < 2) growth = 2;
+		if (growth > 4) growth = 4;
+
+		// don't start a depth after the soft limit or one that can't finish before the hard limit
+		if (now >= soft_stop || now + last_iteration * growth >= hard_stop)
+			break;
+	}
+}
+
+void* helper_thread(void* id)
+{
+	thread_id = (int)(long)id;
+
+	restore_position(&root_position);
+
+	nodes = 0;
+
+	search_position(root_depth);
+
+	// final count, the last published one lags behind
+	atomic_store_explicit(&thread_nodes[thread_id], nodes, memory_order_relaxed);
+
+	return NULL;
+}
+
+void print_best_move()
+{
+	pthread_mutex_lock(&io_lock);
+
+	printf("bestmove ");
+	print_move(root_best_move);
+
+	if (root_ponder_move)
+	{
+		printf(" ponder ");
+		print_move(root_ponder_move);
+	}
+
+	printf("\n");
+
+	pthread_mutex_unlock(&io_lock);
+}
+
+// UCI allows no bestmove while pondering or in infinite mode until the GUI ends the search
+void wait_for_stop()
+{
+	pthread_mutex_lock(&stop_lock);
+
+	while (!stopped && (pondering || infinite))
+		pthread_cond_wait(&stop_cond, &stop_lock);
+
+	pthread_mutex_unlock(&stop_lock);
+}
+
+// "stop" and "quit" end the search, "ponderhit" only ends pondering
+void signal_stop(int stop)
+{
+	pthread_mutex_lock(&stop_lock);
+
+	if (stop)
+		stopped = 1;
+
+	pondering = 0;
+
+	pthread_cond_broadcast(&stop_cond);
+	pthread_mutex_unlock(&stop_lock);
+}
+
+// Lazy SMP: helper threads search the same root sharing only the transposition table
+void select_move(int depth)
+{
+	pthread_t helpers[max_threads];
+	move_list moves[1];
+
+	nodes = 0;
+
+	for (int i = 0; i < thread_count; i++)
+		atomic_store_explicit(&thread_nodes[i], 0, memory_order_relaxed);
+
+	// fallback in case not even the first iteration completes
+	generate_moves(moves, all_moves);
+	root_best_move = moves->count ? moves->moves[0] : 0;
+	root_ponder_move = 0;
+
+	// a forced move needs no thinking when the clock is running
+	if (timeset && !pondering && moves->count == 1)
+	{
+		print_best_move();
+		return;
+	}
+
+	ensure_transpos_table();
+
+	save_position(&root_position);
+	root_depth = depth;
+
+	for (int i = 1; i < thread_count; i++)
+		pthread_create(&helpers[i], NULL, helper_thread, (void*)(long)i);
+
+	search_position(depth);
+
+	wait_for_stop();
+
+	// main thread is done, release the helpers
+	stopped = 1;
+
+	for (int i = 1; i < thread_count; i++)
+		pthread_join(helpers[i], NULL);
+
+	print_best_move();
+}
+
+// search started by "go", the UCI thread keeps reading input meanwhile
+pthread_t search_thread;
+int searching = 0;
+
+void* main_search_thread(void* arg)
+{
+	(void)arg;
+
+	restore_position(&root_position);
+
+	select_move(root_depth);
+
+	return NULL;
+}
+
+// run the search in its own thread so "stop" and "isready" are answered during it
+void start_search(int depth)
+{
+	save_position(&root_position);
+	root_depth = depth;
+
+	// cleared before the thread starts so an early "stop" isn't lost
+	stopped = 0;
+	searching = 1;
+
+	pthread_create(&search_thread, NULL, main_search_thread, NULL);
+}
+
+// wait until a running search has printed its best move
+void wait_for_search()
+{
+	if (!searching)
+		return;
+
+	pthread_join(search_thread, NULL);
+	searching = 0;
+}
+
+// root moves of a perft run, split between the worker threads
+move_list perft_root_moves;
+U64 perft_counts[256];
+int perft_next_move;
+int perft_depth;
+pthread_mutex_t perft_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* perft_thread(void* id)
+{
+	thread_id = (int)(long)id;
+
+	restore_position(&root_position);
+
+	while (1)
+	{
+		// grab the next unclaimed root move
+		pthread_mutex_lock(&perft_lock);
+		int i = perft_next_move++;
+		pthread_mutex_unlock(&perft_lock);
+
+		if (i >= perft_root_moves.count)
+			break;
+
+		make_move(perft_root_moves.moves[i]);
+
+		perft_counts[i] = perft(perft_depth - 1);
+
+		unmake_move();
+	}
+
+	return NULL;
+}
+
+// UCI "go perft" command, prints leaf counts per root move
+U64 perft_test(int depth)
+{
+	pthread_t workers[max_threads];
+
+	if (depth < 1)
+		depth = 1;
+
+	save_position(&root_position);
+	generate_moves(&perft_root_moves, all_moves);
+
+	perft_next_move = 0;
+	perft_depth = depth;
+
+	int start = get_time_ms();
+
+	for (int i = 1; i < thread_count; i++)
+		pthread_create(&workers[i], NULL, perft_thread, (void*)(long)i);
+
+	perft_thread(0);
+
+	for (int i = 1; i < thread_count; i++)
+		pthread_join(workers[i], NULL);
+
+	int time = get_time_ms() - start;
+
+	U64 total = 0;
+
+	for (int i = 0; i < perft_root_moves.count; i++)
+	{
+		print_move(perft_root_moves.moves[i]);
+		printf(": %llu\n", perft_counts[i]);
+
+		total += perft_counts[i];
+	}
+
+	printf("\nNodes searched: %llu\n", total);
+	printf("Time: %d ms\n", time);
+	printf("Mnps: %.2f\n\n", total / 1000.0 / (time + 1));
+
+	return total;
+}
+
+// (re)allocate the perft hash table, 0 MB disables it
+void init_perft_table(int mb)
+{
+	free(perft_table);
+
+	perft_table = NULL;
+	perft_entries = 0;
+
+	if (mb <= 0)
+		return;
+
+	perft_entries = (U64)mb * 1024 * 1024 / sizeof(perft_entry);
+	perft_table = calloc(perft_entries, sizeof(perft_entry));
+
+	if (!perft_table)
+		perft_entries = 0;
+}
 
-		// PVS or principal variation search
-		if (moves_searched == 0)
-			score = -negamax(depth - 1, -beta, -alpha);
-		else
-		{
-			// LMR or late move reduction
-			if (moves_searched >= full_depth_moves && depth >= reduction_limit && in_check == 0 && !get_move_capture(moves->moves[i]) && !get_move_promoted(moves->moves[i]))
-				score = -negamax(depth - 2, -alpha - 1, -alpha);
-			else
-				score = alpha + 1;
+// run the perft counts of an EPD file, lines look like "<fen> ;D1 20 ;D2 400",
+// depths above max_depth are skipped (0 runs all), returns the number of failed positions
+int perft_suite(char* path, int max_depth)
+{
+	FILE* file = fopen(path, "r");
 
-			if (score > alpha)
-			{
-				score = -negamax(depth - 1, -alpha - 1, -alpha);
+	if (!file)
+	{
+		printf("can't open %s\n", path);
+		return 1;
+	}
 
-				if ((score > alpha) && (score < beta))
-					// if LMR fails research at full depth
-					score = -negamax(depth - 1, -beta, -alpha);
-			}
-		}
+	char line[1024];
 
-		ply--;
-		rep_index--;
+	int positions = 0;
+	int failed = 0;
 
-		take_back();
+	U64 total = 0;
+	int total_time = 0;
 
-		if (stopped)
-			return 0;
+	while (fgets(line, sizeof(line), file))
+	{
+		char* field = strchr(line, ';');
 
-		moves_searched++;
+		// blank lines and lines without counts
+		if (!field)
+			continue;
 
-		if (score > alpha)
-		{
-			hash_flag = hash_flag_exact;
+		positions++;
 
-			if (!get_move_capture(moves->moves[i]))
-				history_moves[get_move_piece(moves->moves[i])][get_move_target(moves->moves[i])] += depth;
+		parse_fen(line);
 
-			alpha = score;
+		U64 nodes_searched = 0;
+		int passed = 1;
 
-			pv_table[ply][ply] = moves->moves[i];
+		int start = get_time_ms();
 
-			for (int next_ply = ply + 1; next_ply < pv_length[ply + 1]; next_ply++)
-				pv_table[ply][next_ply] = pv_table[ply + 1][next_ply];
+		while (field)
+		{
+			int depth;
+			U64 expected;
 
-			pv_length[ply] = pv_length[ply + 1];
+			field++;
 
-			if (score >= beta)
+			if (sscanf(field, " D%d %llu", &depth, &expected) == 2 && depth > 0 && (!max_depth || depth <= max_depth))
 			{
-				write_tt_entry(depth, beta, hash_flag_beta);
+				U64 count = perft(depth);
+
+				nodes_searched += count;
 
-				if (!get_move_capture(moves->moves[i]))
+				if (count != expected)
 				{
-					killer_moves[1][ply] = killer_moves[0][ply];
-					killer_moves[0][ply] = moves->moves[i];
+					printf("  D%d expected %llu got %llu\n", depth, expected, count);
+					passed = 0;
 				}
-
-				return beta;
 			}
+
+			field = strchr(field, ';');
 		}
-	}
 
-	if (legal_moves == 0)
-	{
-		if (in_check)
-			return -mate_value + ply;
-		else
-			return 0;
+		int time = get_time_ms() - start;
+
+		failed += !passed;
+		total += nodes_searched;
+		total_time += time;
+
+		*strchr(line, ';') = '\0';
+
+		printf("%s %4d: %6d ms %8.2f Mnps  %s\n", passed ? "pass" : "FAIL", positions, time,
+			nodes_searched / 1000.0 / (time + 1), line);
 	}
 
-	write_tt_entry(depth, alpha, hash_flag);
+	fclose(file);
 
-	return alpha;
+	printf("\n%d positions, %d failed\n", positions, failed);
+	printf("Nodes searched: %llu\n", total);
+	printf("Time: %d ms\n", total_time);
+	printf("Mnps: %.2f\n\n", total / 1000.0 / (total_time + 1));
+
+	return failed;
 }
 
-void select_move(int depth)
+// fixed positions searched by the "bench" command
+char* bench_positions[] = {
+	start_position,
+	tricky_position,
+	killer_position,
+	cmk_position,
+	"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+	"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+	"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+	"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+	"6k1/5ppp/8/8/8/8/5PPP/3R2K1 w - - 0 1",
+	"8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1"
+};
+
+// search every bench position to a fixed depth on a fresh table with one thread,
+// the node total is a signature of the searched tree
+void bench(int depth)
 {
-	nodes = 0;
+	position saved;
+	long total = 0;
 
-	follow_pv = 0;
-	score_pv = 0;
+	int positions = sizeof(bench_positions) / sizeof(bench_positions[0]);
+	int threads = thread_count;
 
-	memset(killer_moves, 0, sizeof(killer_moves));
-	memset(history_moves, 0, sizeof(history_moves));
-	memset(pv_table, 0, sizeof(pv_table));
-	memset(pv_length, 0, sizeof(pv_length));
+	if (depth < 1)
+		depth = default_bench_depth;
 
-	int alpha = -INF;
-	int beta = INF;
-	int score = 0;
+	save_position(&saved);
 
-	for (int current_depth = 1; current_depth <= depth; current_depth++)
-	{
-		if (stopped)
-			break;
+	thread_count = 1;
+	timeset = 0;
+	infinite = 0;
+	pondering = 0;
 
-		follow_pv = 1;
+	int start = get_time_ms();
 
-		score = negamax(current_depth, alpha, beta);
+	for (int i = 0; i < positions; i++)
+	{
+		printf("\nPosition %d/%d: %s\n", i + 1, positions, bench_positions[i]);
 
-		// we went outside the window 
-		if ((score <= alpha) || (score >= beta))
-		{
-			// research with normal alpha and beta
-			alpha = -INF;
-			beta = INF;
-			continue;
-		}
+		parse_fen(bench_positions[i]);
+		clear_transpos_table();
 
-		// setup aspiration window for next iteration, narrowing the scope for each ply
-		alpha = score - 50;
-		beta = score + 50;
+		stopped = 0;
+		starttime = get_time_us();
+		select_move(depth);
 
-		if (score > -mate_value && score < -mate_score)
-			printf("info score mate %d depth %d nodes %ld time %d pv ", -(score + mate_score), current_depth, nodes, get_time_ms() - starttime);
-		else if (score > mate_score && score < mate_value)
-			printf("info score mate %d depth %d nodes %ld time %d pv ", (mate_score - score), current_depth, nodes, get_time_ms() - starttime);
-		else
-			printf("info score cp %d depth %d nodes %ld time %d pv ", score, current_depth, nodes, get_time_ms() - starttime);
+		total += nodes;
+	}
 
-		for (int i = 0; i < pv_length[0]; i++)
-		{
-			print_move(pv_table[0][i]);
-			printf(" ");
-		}
+	int time = get_time_ms() - start;
 
-		printf("\n");
-	}
+	thread_count = threads;
 
-	printf("bestmove ");
-	print_move(pv_table[0][0]);
-	printf("\n");
+	restore_position(&saved);
+
+	printf("\nNodes searched: %ld\n", total);
+	printf("Time: %d ms\n", time);
+	printf("Nps: %ld\n\n", total * 1000 / (time + 1));
 }
 
 int parse_move(char* move_string)
 {
 	move_list moves[1];
 
-	generate_moves(moves);
+	generate_moves(moves, all_moves);
 
 	int from_square = (move_string[0] - 'a') + (8 - (move_string[1] - '0')) * 8;
 	int to_square = (move_string[2] - 'a') + (8 - (move_string[3] - '0')) * 8;
@@ -2238,13 +3950,8 @@ int parse_move(char* move_string)
 
 			if (promoted_piece)
 			{
-				if ((promoted_piece == Q || promoted_piece == q) && move_string[4] == q)
-					return move;
-				else if ((promoted_piece == R || promoted_piece == r) && move_string[4] == r)
-					return move;
-				else if ((promoted_piece == N || promoted_piece == n) && move_string[4] == n)
-					return move;
-				else if ((promoted_piece == B || promoted_piece == b) && move_string[4] == b)
+				// the fifth character names the promoted piece
+				if (promoted_pieces[promoted_piece] == move_string[4])
 					return move;
 
 				continue;
@@ -2296,7 +4003,7 @@ void parse_position(char* command)
 			rep_index++;
 			repetition_table[rep_index] = hash_key;
 
-			make_move(move, all_moves);
+			make_move(move);
 
 			while (*current_char && *current_char != ' ')
 				current_char++;
@@ -2315,8 +4022,27 @@ void parse_go(char* command)
 	// init argument
 	char* argument = NULL;
 
-	// infinite search
-	if ((argument = strstr(command, "infinite"))) {}
+	// match UCI "perft" command
+	if ((argument = strstr(command, "perft")))
+	{
+		perft_test(atoi(argument + 6));
+		return;
+	}
+
+	// a first allocation should not eat into the clock
+	ensure_transpos_table();
+
+	// time control is set up from scratch on every search
+	movestogo = 0;
+	movetime = -1;
+	ttime = -1;
+	inc = 0;
+	timeset = 0;
+
+	infinite = strstr(command, "infinite") != NULL;
+
+	// the time control applies from "ponderhit" on
+	pondering = strstr(command, "ponder") != NULL;
 
 	// match UCI "binc" command
 	if ((argument = strstr(command, "binc")) && side == black)
@@ -2353,75 +4079,220 @@ void parse_go(char* command)
 		// parse search depth
 		depth = atoi(argument + 6);
 
-	// if move time is not available
+	// init start time
+	starttime = get_time_us();
+
 	if (movetime != -1)
 	{
-		// set time equal to move time
-		ttime = movetime;
+		// a fixed move time is both the target and the limit
+		int budget = movetime - move_overhead;
+
+		if (budget < 1) budget = 1;
 
-		// set moves to go to 1
-		movestogo = 1;
+		timeset = 1;
+		soft_stop = starttime + budget * 1000LL;
+		hard_stop = soft_stop;
 	}
+	else if (ttime != -1)
+	{
+		int left = ttime - move_overhead;
+		int moves = movestogo ? movestogo : 30;
 
-	// init start time
-	starttime = get_time_ms();
+		if (left < 1) left = 1;
 
-	// init search depth
-	depth = depth;
+		// keep a reserve for the moves to come, the last move of a control may use it all
+		int max_time = (moves == 1) ? left : left * 3 / 4;
 
-	// if time control is available
-	if (ttime != -1)
-	{
-		// flag we're playing with time control
-		timeset = 1;
+		int budget = left / moves + inc * 3 / 4;
+
+		// pondering wins back time on the opponent's clock
+		if (ponder_option)
+			budget += budget / 4;
 
-		// set up timing
-		ttime /= movestogo;
-		ttime -= 50;
-		stoptime = starttime + ttime + inc;
+		if (budget > max_time) budget = max_time;
+
+		// iterations stop starting halfway through the budget, a running one may overshoot it
+		timeset = 1;
+		soft_stop = starttime + budget / 2 * 1000LL;
+		hard_stop = starttime + (budget * 3 < max_time ? budget * 3 : max_time) * 1000LL;
 	}
 
-	// if depth is not available
+	// without a depth search until time runs out or "stop"
 	if (depth == -1)
-		// set depth to 64 plies (takes ages to complete...)
-		depth = 10;
-
-	// print debug info
-	printf("time:%d start:%d stop:%d depth:%d timeset:%d\n",
-		ttime, starttime, stoptime, depth, timeset);
+		depth = max_ply;
 
 	// search position
-	select_move(depth);
+	start_search(depth);
 }
-void uci_loop()
+
+// the expected move was played, keep searching on our own clock
+void ponder_hit()
 {
-	setbuf(stdin, NULL);
-	setbuf(stdout, NULL);
+	// the limits were set from "go ponder", shift them to start now
+	long long elapsed = get_time_us() - starttime;
 
-	char input[2000];
+	soft_stop += elapsed;
+	hard_stop += elapsed;
+
+	signal_stop(0);
+}
+
+// parse UCI command "setoption"
+void parse_setoption(char* command)
+{
+	char* argument = NULL;
+
+	// match UCI "Threads" option
+	if (strstr(command, "name Threads") && (argument = strstr(command, "value")))
+	{
+		thread_count = atoi(argument + 6);
+
+		if (thread_count < 1) thread_count = 1;
+		if (thread_count > max_threads) thread_count = max_threads;
+	}
+
+	// match UCI "Move Overhead" option
+	else if (strstr(command, "name Move Overhead") && (argument = strstr(command, "value")))
+	{
+		move_overhead = atoi(argument + 6);
+
+		if (move_overhead < 0) move_overhead = 0;
+		if (move_overhead > 5000) move_overhead = 5000;
+	}
+
+	// match UCI "Ponder" option
+	else if (strstr(command, "name Ponder") && (argument = strstr(command, "value")))
+		ponder_option = strncmp(argument + 6, "true", 4) == 0;
+
+	// match UCI "PerftHash" option
+	else if (strstr(command, "name PerftHash") && (argument = strstr(command, "value")))
+	{
+		int mb = atoi(argument + 6);
+
+		if (mb < 0) mb = 0;
+		if (mb > max_perft_hash_mb) mb = max_perft_hash_mb;
+
+		init_perft_table(mb);
+	}
+
+	// match UCI "Hash" option
+	else if (strstr(command, "name Hash") && (argument = strstr(command, "value")))
+	{
+		int mb = atoi(argument + 6);
+
+		if (mb < 1) mb = 1;
+		if (mb > max_hash_mb) mb = max_hash_mb;
+
+		// reallocated with the new size when next needed
+		hash_mb = mb;
+		free_transpos_table();
+	}
+
+	// match UCI "EvalFile" option, the file name runs to the end of the line
+	else if (strstr(command, "name EvalFile") && (argument = strstr(command, "value")))
+	{
+		argument += 5;
+
+		while (*argument == ' ')
+			argument++;
+
+		snprintf(eval_file, sizeof(eval_file), "%s", argument);
+		eval_file[strcspn(eval_file, "\r\n")] = 0;
+
+		nnue_load(eval_file);
+		nnue_refresh();
+
+		// cached evals and search scores came from the previous evaluator
+		clear_eval_cache();
+		clear_transpos_table();
+	}
+
+	// match the search tuning options
+	else
+	{
+		for (int i = 0; i < (int)(sizeof(tune_options) / sizeof(tune_options[0])); i++)
+		{
+			char name[64];
+			sprintf(name, "name %s value", tune_options[i].name);
 
+			if ((argument = strstr(command, name)))
+			{
+				int value = atoi(argument + strlen(name));
+
+				if (value < tune_options[i].min) value = tune_options[i].min;
+				if (value > tune_options[i].max) value = tune_options[i].max;
+
+				*tune_options[i].value = value;
+				break;
+			}
+		}
+	}
+}
+
+void print_engine_info()
+{
 	printf("id name LCCEngine\n");
 	printf("id name Lancer\n");
+	printf("option name Hash type spin default %d min 1 max %d\n", default_hash_mb, max_hash_mb);
+	printf("option name EvalFile type string default <empty>\n");
+	printf("option name Move Overhead type spin default 10 min 0 max 5000\n");
+	printf("option name Ponder type check default false\n");
+	printf("option name PerftHash type spin default 0 min 0 max %d\n", max_perft_hash_mb);
+	printf("option name Threads type spin default 1 min 1 max %d\n", max_threads);
+
+	for (int i = 0; i < (int)(sizeof(tune_options) / sizeof(tune_options[0])); i++)
+		printf("option name %s type spin default %d min %d max %d\n",
+			tune_options[i].name, *tune_options[i].value, tune_options[i].min, tune_options[i].max);
+
 	printf("uciok\n");
+}
 
-	while (1)
-	{
-		memset(input, 0, sizeof(input));
+void uci_loop()
+{
+	setbuf(stdout, NULL);
 
-		fflush(stdout);
+	char input[2000];
 
-		if (!fgets(input, 2000, stdin))
-			continue;
+	print_engine_info();
 
+	// blocks on stdin, end of input quits like "quit"
+	while (fgets(input, sizeof(input), stdin))
+	{
 		if (input[0] == '\n')
 			continue;
 
+		// answered right away, even while searching
 		if (strncmp(input, "isready", 7) == 0)
 		{
+			// allocate the hash while the GUI waits rather than on the clock
+			ensure_transpos_table();
+
+			pthread_mutex_lock(&io_lock);
 			printf("readyok\n");
+			pthread_mutex_unlock(&io_lock);
+
+			continue;
+		}
+		else if (strncmp(input, "stop", 4) == 0)
+		{
+			signal_stop(1);
+			wait_for_search();
+			continue;
+		}
+		else if (strncmp(input, "ponderhit", 9) == 0)
+		{
+			if (searching)
+				ponder_hit();
+
 			continue;
 		}
-		else if (strncmp(input, "position", 8) == 0)
+		else if (strncmp(input, "quit", 4) == 0)
+			break;
+
+		// anything else waits for the search to finish
+		wait_for_search();
+
+		if (strncmp(input, "position", 8) == 0)
 		{
 			parse_position(input);
 			clear_transpos_table();
@@ -2430,53 +4301,177 @@ void uci_loop()
 		{
 			parse_position("position startpos");
 			clear_transpos_table();
+			clear_eval_cache();
 		}
 		else if (strncmp(input, "go", 2) == 0)
 			parse_go(input);
-		else if (strncmp(input, "quit", 4) == 0)
-			break;
+		else if (strncmp(input, "setoption", 9) == 0)
+			parse_setoption(input);
+		else if (strncmp(input, "bench", 5) == 0)
+			bench(atoi(input + 5));
 		else if (strncmp(input, "uci", 3) == 0)
+			print_engine_info();
+	}
+
+	signal_stop(1);
+	wait_for_search();
+}
+
+// fold material and positional tables into one lookup per piece and square
+void init_piece_square_score()
+{
+	for (int square = 0; square < 64; square++)
+	{
+		piece_square_score[P][square] = material_score[P] + pawn_score[square];
+		piece_square_score[N][square] = material_score[N] + knight_score[square];
+		piece_square_score[B][square] = material_score[B] + bishop_score[square];
+		piece_square_score[R][square] = material_score[R] + rook_score[square];
+		piece_square_score[Q][square] = material_score[Q];
+		piece_square_score[K][square] = material_score[K] + king_score[square];
+
+		piece_square_score[p][square] = material_score[p] - pawn_score[mirror_score[square]];
+		piece_square_score[n][square] = material_score[n] - knight_score[mirror_score[square]];
+		piece_square_score[b][square] = material_score[b] - bishop_score[mirror_score[square]];
+		piece_square_score[r][square] = material_score[r] - rook_score[mirror_score[square]];
+		piece_square_score[q][square] = material_score[q];
+		piece_square_score[k][square] = material_score[k] - king_score[mirror_score[square]];
+	}
+}
+
+// masks used by the pawn structure evaluation
+void init_pawn_masks()
+{
+	for (int file = 0; file < 8; file++)
+	{
+		file_masks[file] = 0x0101010101010101ULL << file;
+
+		adjacent_files_masks[file] = 0ULL;
+
+		if (file > 0)
+			adjacent_files_masks[file] |= 0x0101010101010101ULL << (file - 1);
+
+		if (file < 7)
+			adjacent_files_masks[file] |= 0x0101010101010101ULL << (file + 1);
+	}
+
+	for (int square = 0; square < 64; square++)
+	{
+		int file = square & 7;
+		int rank = square >> 3;
+
+		U64 files = file_masks[file] | adjacent_files_masks[file];
+
+		passed_masks[white][square] = passed_masks[black][square] = 0ULL;
+		support_masks[white][square] = support_masks[black][square] = 0ULL;
+
+		// white pawns move towards row 0 (rank 8)
+		for (int row = 0; row < 8; row++)
 		{
-			printf("id name LCCEngine\n");
-			printf("id name Lancer\n");
-			printf("uciok\n");
+			U64 row_mask = 0xffULL << (row * 8);
+
+			if (row < rank)
+				passed_masks[white][square] |= files & row_mask;
+
+			if (row > rank)
+				passed_masks[black][square] |= files & row_mask;
+
+			if (row >= rank)
+				support_masks[white][square] |= adjacent_files_masks[file] & row_mask;
+
+			if (row <= rank)
+				support_masks[black][square] |= adjacent_files_masks[file] & row_mask;
 		}
 	}
 }
 
+// print U64 values as rows of a C initialiser
+void print_table(const U64* table, int size)
+{
+	for (int i = 0; i < size; i++)
+		printf("%s0x%016llxULL,%s", (i % 4) ? " " : "\t", table[i], (i % 4 == 3 || i == size - 1) ? "\n" : "");
+}
+
+// "gentables" writes the startup tables as a header for USE_GENERATED_TABLES
+void generate_tables()
+{
+	printf("// generated by the engine's \"gentables\" mode, do not edit\n\n");
+
+#ifdef USE_PEXT
+	printf("#define generated_tables_pext 1\n\n");
+#else
+	printf("#define generated_tables_pext 0\n\n");
+#endif
+
+	printf("const U64 pawn_attacks[2][64] = {\n");
+	print_table(pawn_attacks[0], 2 * 64);
+	printf("};\n\nconst U64 knight_attacks[64] = {\n");
+	print_table(knight_attacks, 64);
+	printf("};\n\nconst U64 king_attacks[64] = {\n");
+	print_table(king_attacks, 64);
+	printf("};\n\nconst U64 slider_attacks[bishop_table_size + rook_table_size] = {\n");
+	print_table(slider_attacks, bishop_table_size + rook_table_size);
+	printf("};\n\nconst slider_square sliders[64] = {\n");
+
+	for (int square = 0; square < 64; square++)
+	{
+		const slider_magic* bishop_entry = &sliders[square].bishop;
+		const slider_magic* rook_entry = &sliders[square].rook;
+
+		printf("\t{ { 0x%016llxULL, 0x%016llxULL, slider_attacks + %d, %d },\n", bishop_entry->mask, bishop_entry->magic,
+			(int)(bishop_entry->attacks - slider_attacks), bishop_entry->shift);
+		printf("\t  { 0x%016llxULL, 0x%016llxULL, slider_attacks + %d, %d } },\n", rook_entry->mask, rook_entry->magic,
+			(int)(rook_entry->attacks - slider_attacks), rook_entry->shift);
+	}
+
+	printf("};\n\nconst U64 between_squares[64][64] = {\n");
+	print_table(between_squares[0], 64 * 64);
+	printf("};\n\nconst U64 line_squares[64][64] = {\n");
+	print_table(line_squares[0], 64 * 64);
+	printf("};\n");
+}
+
 void init_all()
 {
+	clock_start = get_time_us();
+
+#ifndef USE_GENERATED_TABLES
 	init_leaper_attacks();
 
 	init_slider_attacks(bishop);
 	init_slider_attacks(rook);
 
+	init_line_tables();
+#endif
+
 	init_random_keys();
 
-	clear_transpos_table();
+	init_piece_square_score();
+
+	init_pawn_masks();
 }
 
-int main()
+int main(int argc, char* argv[])
 {
 	init_all();
 
-	uci_loop();
-
-	return 0;
-
-	parse_fen(start_position);
+	// "bench [depth]" on the command line runs the benchmark and exits
+	if (argc > 1 && strcmp(argv[1], "bench") == 0)
+	{
+		bench(argc > 2 ? atoi(argv[2]) : default_bench_depth);
+		return 0;
+	}
 
-	while (1)
+	if (argc > 1 && strcmp(argv[1], "gentables") == 0)
 	{
-		print_board();
+		generate_tables();
+		return 0;
+	}
 
-		int start = get_time_ms();
-		select_move(10);
-		int end = get_time_ms();
+	// "perftsuite <file.epd> [max depth]" checks the move generator, non-zero exit on a mismatch
+	if (argc > 2 && strcmp(argv[1], "perftsuite") == 0)
+		return perft_suite(argv[2], argc > 3 ? atoi(argv[3]) : 0) ? 1 : 0;
 
-		make_move(pv_table[0][0], all_moves);
-		printf("Run time: %dms", end - start);
-	}
+	uci_loop();
 
 	return 0;
 }